@@ -9,27 +9,85 @@
 #include <linux/mutex.h>
 #include <linux/miscdevice.h>
 #include <asm/uaccess.h>
+#include <asm/unaligned.h>
 #include <linux/timer.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+
+#include "labjack_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "labjack_trace.h"
 
 #define LJ_VENDOR_ID  0x0CD5
 #define LJ_PRODUCT_ID 0x0003
 
-#define LJ_NUM_MINORS 3		/* minor char devices per lj */
-#define MAXDEV 8		/* max number of connected ljs */
-#define MINOR_START 135		/* start minor number */
 #define LJ_NAMESIZE 20		/* 20 char max for name. */
-#define LJ_PORTC_FREQ (HZ*1)	/* frequency in jifffies with which to
+#define LJ_PORTC_PERIOD 1000000	/* default period in us with which to
 				 * check the airlock */
+#define LJ_PORTC_MIN_PERIOD 2000 /* shortest portC period in us, about
+				  * two Feedback round trips */
+#define LJ_PORTB_MIN_PERIOD 10	/* shortest portB sample period in ms.
+				 * The temperature doesn't move faster */
+#define LJ_PORTC_SPEEDUP 16	/* portC polls this much faster than its
+				 * period while a rule is about to change */
+#define LJ_PORTC_LOOKAHEAD 4	/* samples ahead a rule counts as about
+				 * to change at its current rate */
 #define LJ_PORTA_FREQ (60)	/* frequency in seconds to run porta*/
-/* keeps track of usb interfaces that are connected */
-static struct lj_state **lj_state_table = NULL;
-
-/* this lock protects the character device registering from stepping
-   on the allocation of the numbers. */
-static struct mutex state_table_lock;
+#define LJ_TICK_NS (500 * NSEC_PER_USEC) /* periodic work is rounded up to
+				 * this, so labjacks share ticks */
+#define LJ_PORTA_HW_MAX (256*65536) /* longest Timer0 period in us */
+#define LJ_CMD_TIMEOUT (HZ/2)	/* how long to wait for a command response */
+#define LJ_MAX_PACKET 64	/* largest command or response the U3 sends */
+#define LJ_POOL_SIZE 10		/* preallocated transfers per lj */
+#define LJ_MAX_INFLIGHT 4	/* commands in flight at once, per lj */
+#define LJ_STREAM_URBS 8	/* urbs kept queued on the stream endpoint */
+#define LJ_STREAM_PKTSIZE 64	/* 14 bytes of header + 25 samples */
+#define LJ_STREAM_FIFO_SIZE 16384 /* samples buffered for the stream port */
+#define LJ_STREAM_MAX_ERRORS 16	/* stream urbs failing in a row before the
+				 * stream is given up on */
+#define LJ_IIO_NUM_AIN 16	/* AIN channels on the IIO device */
+#define LJ_HIST_BUCKETS 20	/* log2 latency buckets, up to 2^19us */
+#define LJ_B_HIST 64		/* portB readings kept for record reads,
+				 * a power of 2 */
+#define LJ_CAL_SHIFT 16		/* fraction bits in the conversion tables */
+#define LJ_CAL_CHANNELS 16	/* FIO and EIO, the channels with tables */
+#define LJ_CAL_VOLT (1LL << 32)	/* 1.0 in the U3's 32.32 fixed point */
+/* labjacks that are connected, by the N in labN */
+static DEFINE_IDR(lj_idr);
+
+/* the same labjacks, by the minor number of each of their char
+ * devices. Lookups only need rcu_read_lock. */
+static DEFINE_IDR(lj_minor_idr);
+
+/* serializes changes to lj_idr and lj_minor_idr */
+static DEFINE_MUTEX(lj_idr_lock);
+
+/* root of the per-labjack debugfs directories */
+static struct dentry *lj_debugfs_root;
+
+/* labjacks with periodic work, and the one timer that runs it for all
+ * of them. lj_tick_lock also protects each labjack's *_next_ns,
+ * a_freq and tick_dead. */
+static LIST_HEAD(lj_tick_list);
+static DEFINE_SPINLOCK(lj_tick_lock);
+static struct hrtimer lj_tick_timer;
+/* when lj_tick_timer fires, if it is queued */
+static u64 lj_tick_expires;
 
 
 static ssize_t bchr_read(struct file *file, char __user *buf, 
@@ -38,6 +96,61 @@ static ssize_t bchr_read(struct file *file, char __user *buf,
 
 static int chr_open(struct inode *inode, struct file *file);
 
+static int chr_release(struct inode *inode, struct file *file);
+
+static int cchr_open(struct inode *inode, struct file *file);
+
+static int cchr_release(struct inode *inode, struct file *file);
+
+static int statchr_mmap(struct file *file, struct vm_area_struct *vma);
+
+static ssize_t scanchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off);
+
+static long scanchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg);
+
+static long diochr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg);
+
+static ssize_t countchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off);
+
+static long countchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg);
+
+static ssize_t outchr_write(struct file *file, const char __user *buf,
+			size_t size, loff_t *off);
+
+static unsigned int outchr_poll(struct file *file, poll_table *wait);
+
+static long outchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg);
+
+static int groupchr_open(struct inode *inode, struct file *file);
+
+static int groupchr_release(struct inode *inode, struct file *file);
+
+static ssize_t groupchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off);
+
+static unsigned int groupchr_poll(struct file *file, poll_table *wait);
+
+static long groupchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg);
+
+static int bchr_open(struct inode *inode, struct file *file);
+
+static int bchr_release(struct inode *inode, struct file *file);
+
+static long bchr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+static unsigned int bchr_poll(struct file *file, poll_table *wait);
+
+static unsigned int cchr_poll(struct file *file, poll_table *wait);
+
+static long cchr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 
 static ssize_t achr_read(struct file *file, char __user *buf, 
 			size_t size, loff_t *off);
@@ -46,6 +159,8 @@ static int achr_open(struct inode *inode, struct file *file);
 
 static int achr_release(struct inode *inode, struct file *file);
 
+static long achr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 static ssize_t achr_write(struct file * file, const char __user *buf,
 			size_t len, loff_t *offset);
 
@@ -53,6 +168,15 @@ static ssize_t achr_write(struct file * file, const char __user *buf,
 static ssize_t cchr_read(struct file *file, char __user *buf, 
 			size_t size, loff_t *off);
 
+static ssize_t schr_read(struct file *file, char __user *buf, 
+			size_t size, loff_t *off);
+
+static int schr_open(struct inode *inode, struct file *file);
+
+static int schr_release(struct inode *inode, struct file *file);
+
+static long schr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 static void fix_checksum16(u8* packet, u16 size);
 static void fix_checksum8(u8* packet, u16 size);
 
@@ -65,60 +189,593 @@ static struct file_operations achr_ops = {
 	.read = achr_read,
 	.write = achr_write,
 	.open = achr_open,
-	.release = achr_release
+	.release = achr_release,
+	.unlocked_ioctl = achr_ioctl,
 };
 
 
 static struct file_operations bchr_ops = {
 	.owner = THIS_MODULE,
 	.read = bchr_read,
-	.open = chr_open,
+	.open = bchr_open,
+	.release = bchr_release,
+	.unlocked_ioctl = bchr_ioctl,
+	.poll = bchr_poll,
 };
 
 
 static struct file_operations cchr_ops = {
 	.owner = THIS_MODULE,
 	.read = cchr_read,
+	.open = cchr_open,
+	.release = cchr_release,
+	.poll = cchr_poll,
+	.unlocked_ioctl = cchr_ioctl,
+};
+
+
+static struct file_operations schr_ops = {
+	.owner = THIS_MODULE,
+	.read = schr_read,
+	.open = schr_open,
+	.release = schr_release,
+	.unlocked_ioctl = schr_ioctl,
+};
+
+
+static struct file_operations statchr_ops = {
+	.owner = THIS_MODULE,
+	.open = chr_open,
+	.release = chr_release,
+	.mmap = statchr_mmap,
+};
+
+
+static struct file_operations scanchr_ops = {
+	.owner = THIS_MODULE,
+	.read = scanchr_read,
 	.open = chr_open,
+	.release = chr_release,
+	.unlocked_ioctl = scanchr_ioctl,
+};
+
+
+static struct file_operations diochr_ops = {
+	.owner = THIS_MODULE,
+	.open = chr_open,
+	.release = chr_release,
+	.unlocked_ioctl = diochr_ioctl,
+};
+
+
+static struct file_operations countchr_ops = {
+	.owner = THIS_MODULE,
+	.read = countchr_read,
+	.open = chr_open,
+	.release = chr_release,
+	.unlocked_ioctl = countchr_ioctl,
+};
+
+
+static struct file_operations outchr_ops = {
+	.owner = THIS_MODULE,
+	.write = outchr_write,
+	.poll = outchr_poll,
+	.open = chr_open,
+	.release = chr_release,
+	.unlocked_ioctl = outchr_ioctl,
+};
+
+
+static struct file_operations groupchr_ops = {
+	.owner = THIS_MODULE,
+	.read = groupchr_read,
+	.poll = groupchr_poll,
+	.open = groupchr_open,
+	.release = groupchr_release,
+	.unlocked_ioctl = groupchr_ioctl,
+};
+
+/* sampling groups span labjacks, so they have a device of their own */
+static struct miscdevice lj_group_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "labjack_group",
+	.fops = &groupchr_ops,
 };
 
 enum airlock_state {air_open, air_closed, air_error};
 
+/* flags in lj_req.flags */
+#define LJ_REQ_RAW	(1 << 0) /* a whole command, not a Feedback IOType */
+#define LJ_REQ_PENDING	(1 << 1) /* queued or in flight */
+#define LJ_REQ_OWN	(1 << 2) /* shares a packet only with its batch */
+
+/* one unit of work for a labjack. Feedback requests hold a single
+ * IOType and its response data, and are packed together with whatever
+ * else is pending when the pipe frees up. Raw requests hold a whole
+ * command and response, and always go out alone. */
+struct lj_req {
+	/* links the request into its class's queue, or its transfer's
+	 * batch */
+	struct list_head list;
+	/* LJ_REQ_* flags */
+	unsigned int flags;
+	/* LJ_PRIO_* class it is queued in */
+	int prio;
+	/* the IOType bytes, or the whole command */
+	u8 cmd[LJ_MAX_PACKET];
+	int cmd_len;
+	/* IOTypes in cmd, for matching the U3's error frame. 0 counts
+	 * as 1. */
+	int frames;
+	/* the IOType's response data, or the whole response */
+	u8 resp[LJ_MAX_PACKET];
+	int resp_len;
+	/* 0 (or bytes received, for raw requests) or -errno */
+	int result;
+	/* called once the request completes, from atomic context */
+	void (*done)(struct lj_req *req);
+	void *context;
+	/* LJ_KIND_*, and when the request was queued */
+	int kind;
+	ktime_t start;
+};
+
+/* default rate limits, in requests a second and burst. Outputs are
+ * limited too, or a busy writer could starve the polls. */
+#define LJ_OUTPUT_RATE	2000
+#define LJ_OUTPUT_BURST	64
+#define LJ_POLL_RATE	1000
+#define LJ_POLL_BURST	32
+
+/* one scheduling class: its queue, its token bucket and its stats.
+ * Protected by req_lock. */
+struct lj_sched {
+	struct list_head queue;
+	/* requests a second and burst, 0 for no limit. Each request
+	 * costs cost_ns of credit, which builds up with time. */
+	u32 rate;
+	u32 burst;
+	u64 cost_ns;
+	s64 credit_ns;
+	u64 last_ns;
+	u32 depth;
+	u32 max_depth;
+	u64 sent;
+	u64 throttled;
+	u64 wait_ns_total;
+	u64 wait_ns_max;
+};
+
+/* steps the out port's ring holds, a power of two */
+#define LJ_OUT_RING	1024
+
+/* a step in the out port's ring, checked and converted to what the
+ * U3 takes: a DAC's 8 bit value, or the lines and levels to write */
+struct lj_out_ent {
+	u64 time_ns;
+	u32 mask;
+	u32 bits;
+	u8 type;
+};
+
+/* per-CPU counters for every labjack, summed up when debugfs reads
+ * them */
+struct lj_stats {
+	/* requests by kind and log2 of their latency in us */
+	u64 latency[LJ_NUM_KINDS][LJ_HIST_BUCKETS];
+	u64 errors[LJ_NUM_KINDS];
+	/* responses the labjack sent back as bad checksum */
+	u64 checksum_errors;
+	/* bytes moved on the bulk endpoints */
+	u64 bytes_out;
+	u64 bytes_in;
+};
+
+/* the U3's calibration constants, in its 32.32 fixed point. AIN is in
+ * volts per bit and volts, the DACs in bits per volt and bits, and the
+ * temperature sensor in kelvin per bit. */
+struct lj_cal {
+	s64 se_slope;
+	s64 se_offset;
+	s64 diff_slope;
+	s64 diff_offset;
+	s64 dac_slope[2];
+	s64 dac_offset[2];
+	s64 temp_slope;
+	s64 vref;
+};
+
+/* nominal U3-LV values, used until the real ones are read */
+static const struct lj_cal lj_cal_nominal = {
+	.se_slope = 159906,		/* 37.231uV */
+	.se_offset = 0,
+	.diff_slope = 319816,		/* 74.463uV */
+	.diff_offset = -10479720202LL,	/* -2.44V */
+	.dac_slope = {222122823647LL, 222122823647LL},	/* 51.717 */
+	.dac_offset = {0, 0},
+	.temp_slope = 55924769,		/* 13.021mK */
+	.vref = 10479720202LL,		/* 2.44V */
+};
+
+/* ranges of the AIN conversion tables */
+enum {LJ_CAL_SE, LJ_CAL_DIFF, LJ_CAL_SPECIAL, LJ_CAL_RANGES};
+
+/* converts a raw reading to (raw * slope + offset) >> LJ_CAL_SHIFT */
+struct lj_cal_entry {
+	s64 slope;
+	s64 offset;
+};
+
+/* a portC rule and what it has seen so far */
+struct lj_rule_state {
+	struct lj_rule cfg;
+	struct lj_state *state;
+	/* AIN request sampling cfg.channel */
+	struct lj_req req;
+	/* 1 high, 0 low, -1 before the first sample */
+	int level;
+	/* samples in a row past the threshold, for debouncing */
+	int count;
+	/* previous sample, for the rate limit */
+	u16 last;
+	int have_last;
+};
+
+enum {LJ_XFER_OUT, LJ_XFER_WAIT};
+
+/* a preallocated urb with DMA-coherent buffers for one command and its
+ * response. Transfers live in a pool in the lj_state, and are handed
+ * back to it by the completion handlers. */
+struct lj_xfer {
+	struct lj_state *state;
+	struct urb *urb;
+	u8 *snd_packet;
+	dma_addr_t snd_dma;
+	u8 *rcv_packet;
+	dma_addr_t rcv_dma;
+	/* links free transfers into pool_free */
+	struct list_head list;
+	/* requests packed into this transfer */
+	struct list_head batch;
+	/* bytes expected back on EP2, and bytes that came back */
+	int rcv_size;
+	int rcv_len;
+	/* nonzero if the batch is a raw request */
+	int raw;
+	/* requests in the batch */
+	int nreqs;
+	/* echo byte of the Feedback packet */
+	u8 echo;
+	/* LJ_XFER_OUT while sending, LJ_XFER_WAIT while waiting for the
+	 * response */
+	int phase;
+	/* jiffies when the transfer was sent */
+	unsigned long start;
+	/* links the transfer into req_inflight */
+	struct list_head inflight;
+};
+
 struct lj_state {
+	/* held by the usb interface and every open file */
+	struct kref kref;
+	struct rcu_head rcu;
+	/* the N in labN */
+	int devid;
 	/* used to sling messages around through the USB. */
 	struct usb_device *usb_device;
-	/* prevents multiple hardware requests at once, per labjack. */
-	spinlock_t *hw_lock;
 	/* miscdevice struct for portA */
 	struct miscdevice achr_device;
 	/* miscdevice struct for portB */
 	struct miscdevice bchr_device;
 	/* miscdevice struct for portC */
 	struct miscdevice cchr_device;
-	/* waitqueue used to block portB read syscall until URB completes */
-	wait_queue_head_t b_waitqueue;
-	/* field to hold value of tempurature. 
-	 curtemp == INT_MAX when blocked.
-	 curtemp == -INT_MAX when invalid.*/
+	/* last tempurature read by portB, in degrees C */
 	int curtemp;
-	/* timer used by portC to check EIN2's voltage at 1Hz */
-	struct timer_list c_poll_timer;
+	/* when curtemp was read, from ktime_get_ns. 0 if never */
+	u64 curtemp_ns;
+	/* the last LJ_B_HIST readings, for LJ_B_FORMAT_RECORD. Reading
+	 * n is at n % LJ_B_HIST, and b_hist_head is the next one. */
+	struct lj_temp_record b_hist[LJ_B_HIST];
+	u64 b_hist_head;
+	/* protects curtemp, curtemp_ns and the history, which are
+	 * written from urb completions and read by every portB reader */
+	seqlock_t temp_lock;
+	/* period of the portB sampler in ms, 0 if it is off */
+	unsigned int b_sample_ms;
+	/* serializes changes to the sampler period */
+	struct mutex b_sample_mutex;
+	/* the one AIN30 read portB has in flight. The sampler and every
+	 * reader share it, so concurrent reads cost one round trip. */
+	struct lj_req b_req;
+	/* protects the fields below, written from urb completions */
+	spinlock_t b_lock;
+	/* b_req is in flight */
+	int b_busy;
+	/* bumped each time b_req finishes, with its result in b_temp or
+	 * b_err */
+	unsigned long b_gen;
+	int b_temp;
+	int b_err;
+	/* woken when a portB reading arrives */
+	wait_queue_head_t b_waitqueue;
+	/* links the labjack into lj_tick_list while it has periodic
+	 * work */
+	struct list_head tick_node;
+	/* when the shared tick next polls portC, samples portB and
+	 * toggles portA, 0 if it doesn't */
+	u64 c_next_ns;
+	u64 b_next_ns;
+	u64 a_next_ns;
+	/* the labjack is off the tick for good */
+	int tick_dead;
+	/* serializes starting and stopping portC's polling. It only runs
+	 * once someone waits on portC, and until the last portC file is
+	 * closed. */
+	struct mutex c_mutex;
+	/* open portC files */
+	int c_users;
+	/* portC is polling */
+	int c_active;
+	/* the slowest portC polls go, in us. They speed up to
+	 * c_period_us / LJ_PORTC_SPEEDUP while a rule is about to change,
+	 * and back off again once everything is stable. */
+	u32 c_period_us;
+	/* the period portC is polling with right now */
+	u32 c_cur_us;
+	/* some rule was about to change in the last poll. Protected by
+	 * rules_lock. */
+	int c_hot;
+	/* portC polls skipped because the callback ran late */
+	u32 c_missed;
 	/* waitqueue for portC processes that are blocking */
 	wait_queue_head_t c_waitqueue;
 	/* this flag is used to determine whether or not the read
 	 * calls on portC will unblock. Because only one person ever
 	 * writes to this location, we don't need to lock it. */
 	enum airlock_state  airlock;
-	/* locks access to portA's frequency variable */
-	spinlock_t *a_lock;
-	/* controls the frequency with which porta is toggled */
+	/* seconds between toggles of fio_4 from the host */
 	int a_freq;
 	/* current state of fio_4 */
 	int fio4_state;
-	/* timer used to periodically toggle value of fio4 */
-	struct timer_list a_poll_timer;
+	/* serializes changes to how portA drives fio_4 */
+	struct mutex a_mutex;
+	/* period fio_4 is toggling with in us, 0 if it isn't */
+	u32 a_period_us;
+	/* Timer0 is driving fio_4, and when it started, in ns */
+	int a_hw;
+	u64 a_hw_start;
+	/* shadow of the ConfigIO settings, see lj_config_io */
+	struct mutex cfg_mutex;
+	u8 cfg_timer;
+	u8 cfg_fio_analog;
+	u8 cfg_eio_analog;
+	/* what the timers and counters are used for, see
+	 * lj_timers_apply. Protected by cfg_mutex. portA's Timer0 mode,
+	 * value and clock divisor: */
+	int tmr_a;
+	int tmr_a_mode;
+	int tmr_a_value;
+	int tmr_a_div;
+	/* the counter port's input timer mode, 0 if off, and Counter1 */
+	int tmr_in_mode;
+	int tmr_counter;
+	struct lj_req tmr_reqs[2];
+	/* BitStateWrite request used to set fio_4 */
+	struct lj_req fio4_req;
+	/* level fio4_req should leave fio_4 at */
+	int fio4_want;
+	/* rules evaluated on every portC poll */
+	struct lj_rule_state rules[LJ_MAX_RULES];
+	/* protects rules and events */
+	spinlock_t rules_lock;
+	/* events raised by the rules, waiting for portC readers */
+	DECLARE_KFIFO(events, struct lj_event, 64);
+	/* events dropped because nobody collected them */
+	u32 events_lost;
+	/* miscdevice struct for the stream port */
+	struct miscdevice schr_device;
+	/* miscdevice struct for the status page */
+	struct miscdevice statchr_device;
+	/* page mapped read only by statchr_mmap, see lj_status_begin */
+	struct lj_status_page *status;
+	spinlock_t status_lock;
+	/* calibration read at probe, and the tables built from it */
+	struct lj_cal cal;
+	struct lj_cal_entry cal_ain[LJ_CAL_CHANNELS][LJ_CAL_RANGES];
+	struct lj_cal_entry cal_temp;
+	/* miscdevice struct for the scan port */
+	struct miscdevice scanchr_device;
+	/* channels a read of the scan port returns, and the table entry
+	 * each one converts with */
+	struct lj_scan_list scan;
+	const struct lj_cal_entry *scan_cal[LJ_SCAN_MAX];
+	/* miscdevice struct for the digital IO port */
+	struct miscdevice diochr_device;
+	/* serializes the digital IO port, and protects the shadow of the
+	 * lines' levels and directions. Only the bits in the known masks
+	 * are trusted. */
+	struct mutex dio_mutex;
+	u32 dio_state;
+	u32 dio_dir;
+	u32 dio_state_known;
+	u32 dio_dir_known;
+	struct lj_req dio_reqs[2];
+	/* miscdevice struct for the counter port */
+	struct miscdevice countchr_device;
+	/* miscdevice struct for the out port */
+	struct miscdevice outchr_device;
+	/* serializes writers of the out port */
+	struct mutex out_mutex;
+	/* protects the out port's ring, playback state and stats */
+	spinlock_t out_lock;
+	/* steps waiting to play. head and tail count up forever. */
+	struct lj_out_ent *out_ring;
+	unsigned int out_head;
+	unsigned int out_tail;
+	/* time of the last step written, steps have to come in order */
+	u64 out_last_ns;
+	/* when playback started, if it is running */
+	u64 out_t0;
+	int out_running;
+	/* out_timer is queued, and out_req is in flight */
+	int out_armed;
+	int out_busy;
+	/* DIO lines steps have set since playback last stopped, which
+	 * the dio port can't trust its shadow of */
+	u32 out_lines;
+	struct hrtimer out_timer;
+	struct lj_req out_req;
+	wait_queue_head_t out_waitqueue;
+	struct lj_out_stats out_stats;
+	/* protects scan, and scan_reqs while a scan runs */
+	struct mutex scan_mutex;
+	struct lj_req scan_reqs[LJ_SCAN_MAX];
+	u32 scan_seq;
+	/* serializes starting and stopping the stream, and readers of
+	 * stream_fifo. */
+	struct mutex stream_mutex;
+	/* nonzero while someone has the stream port open */
+	int stream_open;
+	/* nonzero while the U3 is streaming */
+	int stream_running;
+	/* set to -ENODEV when the hardware goes away */
+	int stream_err;
+	/* sent to the U3 with StreamConfig on the next start */
+	struct lj_stream_config stream_cfg;
+	/* bulk IN urbs kept queued on EP3 while streaming */
+	struct urb *stream_urbs[LJ_STREAM_URBS];
+	/* decoded samples waiting to be read from the stream port */
+	DECLARE_KFIFO_PTR(stream_fifo, u16);
+	/* protects stream_fifo, stream_stats, stream_fails and
+	 * stream_failed against the stream completion handlers */
+	spinlock_t stream_lock;
+	/* stream urbs that have failed in a row */
+	int stream_fails;
+	/* set once stream_fails reaches LJ_STREAM_MAX_ERRORS. The urbs
+	 * stop resubmitting, and the next reader stops the stream. */
+	int stream_failed;
+	/* waitqueue for readers of the stream port */
+	wait_queue_head_t s_waitqueue;
+	/* packet counter we expect in the next StreamData packet */
+	u8 stream_next_pkt;
+	struct lj_stream_stats stream_stats;
+	/* transfers used for every command sent to the labjack */
+	struct lj_xfer pool[LJ_POOL_SIZE];
+	/* transfers that are not in flight */
+	struct list_head pool_free;
+	/* protects pool_free and the pool counters */
+	spinlock_t pool_lock;
+	/* process context waits here for a free transfer */
+	wait_queue_head_t pool_waitqueue;
+	/* number of times a transfer was wanted but none were free */
+	u32 pool_exhausted;
+	/* transfers currently in flight, and the most ever in flight */
+	u32 pool_in_use;
+	u32 pool_max_in_use;
+	/* this labjack's debugfs directory */
+	struct dentry *debugfs_dir;
+	struct lj_stats __percpu *stats;
+	/* IIO front end, NULL without IIO support */
+	struct iio_dev *iio_dev;
+	/* requests waiting for the pipe to free up, by class */
+	struct lj_sched sched[LJ_NUM_PRIO];
+	/* protects sched, the pipeline and the rx counts */
+	spinlock_t req_lock;
+	/* transfers in flight, oldest first */
+	struct list_head req_inflight;
+	int req_ninflight;
+	/* nonzero while a raw command has the pipe to itself */
+	int req_barrier;
+	/* nonzero once the hardware is gone */
+	int req_dead;
+	/* next echo byte to hand out */
+	u8 next_echo;
+	/* IN urbs queued on EP2, and responses we are waiting for */
+	int rx_posted;
+	int rx_awaiting;
+	/* fails transfers whose response never came */
+	struct timer_list req_timer;
+	/* responses that matched nothing in flight, timed out transfers,
+	 * and the deepest the pipeline has been */
+	u32 req_stray;
+	u32 req_timeouts;
+	u32 req_max_inflight;
+	/* Feedback packets sent, and the requests packed into them */
+	u32 fb_packets;
+	u32 fb_reqs;
+};
+
+/* state behind a labjack's IIO device */
+struct lj_iio {
+	struct lj_state *state;
+	/* one AIN request per channel in the scan */
+	struct lj_req reqs[LJ_IIO_NUM_AIN + 1];
+	/* a scan, with room for the timestamp after it */
+	u16 scan[ALIGN((LJ_IIO_NUM_AIN + 1) * 2, 8) / 2 + 4] __aligned(8);
+};
+
+/* per-open state for portB */
+struct lj_bfile {
+	struct lj_state *state;
+	/* oldest cached reading this reader accepts, in ms. 0 means
+	 * twice the sampler period */
+	u32 max_age_ms;
+	/* LJ_B_FORMAT_* */
+	int format;
+	/* protects the fields below */
+	spinlock_t lock;
+	/* poll or a nonblocking read is waiting for generation
+	 * want_gen of the shared read */
+	int pending;
+	unsigned long want_gen;
+	/* the next reading in b_hist a record read returns */
+	u64 hist_pos;
+};
+
+/* one channel of a sampling group: a labjack and the AIN read it
+ * sends each tick */
+struct lj_group_chan {
+	struct lj_group *group;
+	struct lj_state *state;
+	const struct lj_cal_entry *cal;
+	struct lj_req req;
+	int index;
 };
 
+/* a sampling group, one per open of /dev/labjack_group */
+struct lj_group {
+	/* serializes setting up and stopping the group */
+	struct mutex mutex;
+	/* protects rec, outstanding, tick, missed and records */
+	spinlock_t lock;
+	struct hrtimer timer;
+	ktime_t period;
+	int count;
+	struct lj_group_chan chans[LJ_GROUP_MAX];
+	/* the tick being gathered, and the reads it still waits for */
+	struct lj_group_record rec;
+	int outstanding;
+	u64 tick;
+	u32 missed;
+	DECLARE_KFIFO(records, struct lj_group_record, 16);
+	/* woken when a record is ready, and when no reads are out */
+	wait_queue_head_t waitqueue;
+	wait_queue_head_t idle_waitqueue;
+};
+
+static void lj_stream_stop(struct lj_state *state);
+static enum hrtimer_restart out_timer_cbk(struct hrtimer *timer);
+static void lj_out_stop(struct lj_state *state);
+static long lj_common_ioctl(struct lj_state *state, unsigned int cmd,
+			unsigned long arg);
+static void lj_xfer_finish(struct lj_xfer *xfer, int status);
+static void lj_xfer_out_cbk(struct urb *urb);
+static void lj_rx_cbk(struct urb *urb);
+static void set_fio4_lvl(struct lj_state *state, int lvl);
+static int lj_cmd_sync(struct lj_state *state, const u8 *snd, int sndsize,
+		u8 *rcv, int rcvsize);
+
 static struct usb_device_id id_table [] = {
 	{  USB_DEVICE(LJ_VENDOR_ID, LJ_PRODUCT_ID) },
 	{ }
@@ -145,916 +802,4434 @@ static int was_err(u8 *buf, int len)
 }
 
 
-static void fio4_in_cbk(struct urb *urb)
+/* takes a transfer out of the pool. Returns NULL if every transfer is
+ * in flight. Safe to call from atomic context. */
+static struct lj_xfer *lj_xfer_get(struct lj_state *state)
 {
-	u8 *rcv_packet;
-	struct lj_state *curstate;
+	struct lj_xfer *xfer = NULL;
+	unsigned long flags;
 
-	printk(KERN_INFO "in fio4 in callback\n");
-	curstate = (struct lj_state*)urb->context;
-	rcv_packet = urb->transfer_buffer;
-	
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in fio4 IN cbk.\n");
-		/* for some reason we got shutdown. abort. */
-	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in fio4 urb in cbk: %d.\n", 
-			urb->status);
-	}
-	
-	
-	else if (was_err(rcv_packet, urb->actual_length)){
-		printk(KERN_INFO "bad checksum in fio4 in cbk!\n");
-		
+	spin_lock_irqsave(&state->pool_lock, flags);
+	if(list_empty(&state->pool_free)){
+		state->pool_exhausted++;
+		goto out;
 	}
-	else if (rcv_packet[6]){
-		printk(KERN_INFO "error in fio4 in cbk: %d", rcv_packet[6]);
-		
-	}
-	
-	kfree(rcv_packet);
-	spin_unlock(curstate->hw_lock);
-	return;
+	xfer = list_first_entry(&state->pool_free, struct lj_xfer, list);
+	list_del(&xfer->list);
+	state->pool_in_use++;
+	if(state->pool_in_use > state->pool_max_in_use)
+		state->pool_max_in_use = state->pool_in_use;
+out:
+	spin_unlock_irqrestore(&state->pool_lock, flags);
+	return xfer;
 }
 
-
-static void fio4_out_cbk(struct urb *urb)
+/* gives a transfer back to the pool once its urb has completed. */
+static void lj_xfer_put(struct lj_xfer *xfer)
 {
-	u8 *rcv_packet = NULL;
-	struct lj_state *curstate;
-	const int RCVSIZE = 10;
-	int result;
-	u8 *snd_packet;
+	struct lj_state *state = xfer->state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&state->pool_lock, flags);
+	list_add(&xfer->list, &state->pool_free);
+	state->pool_in_use--;
+	spin_unlock_irqrestore(&state->pool_lock, flags);
+	wake_up(&state->pool_waitqueue);
+}
 
-	printk(KERN_INFO "in fio4 out callback\n");
-	curstate = (struct lj_state*)urb->context;
-	snd_packet = urb->transfer_buffer;
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in fio4 callback.\n");
-		/* for some reason we got shutdown. abort. */
-		goto error;
-	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in fio4 urb out cbk: %d.\n", 
-			urb->status);
-		goto error;
-	}
+/* points the transfer's urb at EP1 and the command in snd_packet */
+static void lj_fill_out(struct lj_xfer *xfer, int size, usb_complete_t cbk)
+{
+	struct usb_device *usb_device = xfer->state->usb_device;
 
-	rcv_packet = kmalloc(sizeof(u8)*RCVSIZE, GFP_ATOMIC);
-	
-	if(!rcv_packet){
-		printk(KERN_INFO "Could not allocate memory for rcv!\n");
-		goto error;
-	}
-	usb_fill_bulk_urb(urb, curstate->usb_device,
-			usb_rcvbulkpipe(curstate->usb_device, 2),
-			rcv_packet, RCVSIZE, fio4_in_cbk, curstate);
-	
-	result = usb_submit_urb(urb, GFP_ATOMIC);
-	if(result)
-	{
-		printk("Could not submit portB IN urb!\n");
-		goto err_rcv;
-	}
+	usb_fill_bulk_urb(xfer->urb, usb_device,
+			usb_sndbulkpipe(usb_device, 1),
+			xfer->snd_packet, size, cbk, xfer);
+	xfer->urb->transfer_dma = xfer->snd_dma;
+	xfer->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+}
 
-	kfree(snd_packet);
-	return;
+/* points the transfer's urb at EP2 and rcv_packet */
+static void lj_fill_in(struct lj_xfer *xfer, int size, usb_complete_t cbk)
+{
+	struct usb_device *usb_device = xfer->state->usb_device;
 
-err_rcv:
-	kfree(rcv_packet);
-	
-error:
-	kfree(snd_packet);
-	spin_unlock(curstate->hw_lock);
-	return;
-	
+	usb_fill_bulk_urb(xfer->urb, usb_device,
+			usb_rcvbulkpipe(usb_device, 2),
+			xfer->rcv_packet, size, cbk, xfer);
+	xfer->urb->transfer_dma = xfer->rcv_dma;
+	xfer->urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
 }
 
-static void set_fio4_lvl (struct lj_state *state, int lvl)
+static void lj_pool_free(struct lj_state *state)
 {
-	struct urb *urb;
-	const int SNDSIZE = 10;
-	u8 *snd_packet = NULL;
-	int result;
-
-	
-	printk(KERN_INFO "setting fio4 to %d\n", lvl);
-	
-	snd_packet = kzalloc(sizeof(u8)*SNDSIZE, GFP_ATOMIC);
-	if(!snd_packet){
-		printk(KERN_INFO "Could not allocate snd_packet for fio4\n");
-		goto error;
+	int i;
+	struct lj_xfer *xfer;
+
+	for(i = 0; i < LJ_POOL_SIZE; i++){
+		xfer = &state->pool[i];
+		if(!xfer->urb)
+			continue;
+		usb_kill_urb(xfer->urb);
+		if(xfer->snd_packet)
+			usb_free_coherent(state->usb_device, LJ_MAX_PACKET,
+					xfer->snd_packet, xfer->snd_dma);
+		if(xfer->rcv_packet)
+			usb_free_coherent(state->usb_device, LJ_MAX_PACKET,
+					xfer->rcv_packet, xfer->rcv_dma);
+		usb_free_urb(xfer->urb);
+		xfer->urb = NULL;
 	}
+}
 
- 	/* 8bit checksum */
-	snd_packet[1] = 0xf8;
-	snd_packet[2] = 0x2; 		/* number of words is .5 + 1.5 */
-	snd_packet[3] = 0x00;
-	/* 16bit checksum */
-	snd_packet[6] = 0x00;		/* echo can be whatever we want */
-	snd_packet[7] = 11;		/* Do a digital set */
-	snd_packet[8] = (lvl << 7) + 4; /* set FIO4 to: lvl */
-	snd_packet[9] = 00;		/* padding*/
-
-	fix_checksum16(snd_packet, SNDSIZE);
-	
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	
-	urb->transfer_flags = 0;
-	usb_fill_bulk_urb(urb, state->usb_device, 
-			usb_sndbulkpipe(state->usb_device, 1), 
-			snd_packet, SNDSIZE, fio4_out_cbk, state);
-
-	spin_lock(state->hw_lock);
-	
-	result = usb_submit_urb(urb, GFP_ATOMIC);
-	if(result){
-		WARN_ON(result);	
-		goto err_spin;
+static int lj_pool_alloc(struct lj_state *state)
+{
+	int i;
+	struct lj_xfer *xfer;
+
+	INIT_LIST_HEAD(&state->pool_free);
+	spin_lock_init(&state->pool_lock);
+	init_waitqueue_head(&state->pool_waitqueue);
+
+	for(i = 0; i < LJ_POOL_SIZE; i++){
+		xfer = &state->pool[i];
+		xfer->state = state;
+		INIT_LIST_HEAD(&xfer->batch);
+		INIT_LIST_HEAD(&xfer->inflight);
+		xfer->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if(!xfer->urb)
+			goto error;
+		xfer->snd_packet = usb_alloc_coherent(state->usb_device,
+						LJ_MAX_PACKET, GFP_KERNEL,
+						&xfer->snd_dma);
+		xfer->rcv_packet = usb_alloc_coherent(state->usb_device,
+						LJ_MAX_PACKET, GFP_KERNEL,
+						&xfer->rcv_dma);
+		if(!xfer->snd_packet || !xfer->rcv_packet)
+			goto error;
+		list_add_tail(&xfer->list, &state->pool_free);
 	}
-	
-	return;
+	return 0;
 
-err_spin:
-	kfree(snd_packet);
-	spin_unlock(state->hw_lock);
 error:
-	return;
+	lj_pool_free(state);
+	return -ENOMEM;
 }
 
-/* debug function to print an array to /var/log/messages. This is done
-   using */
-static void print_arr(u8* data, int size)
+/* picks an echo byte that no transfer in flight is using. Called with
+ * req_lock held. */
+static u8 lj_next_echo(struct lj_state *state)
 {
-	int i;
-	printk("[ ");
-	for(i = 0; i < size - 1; i++)
-		printk("0x%x, ", data[i]);
-	printk("0x%x ]", data[size - 1]);
+	struct lj_xfer *xfer;
+	u8 echo;
+
+again:
+	echo = state->next_echo++;
+	list_for_each_entry(xfer, &state->req_inflight, inflight){
+		if(!xfer->raw && xfer->echo == echo)
+			goto again;
+	}
+	return echo;
 }
 
-static void fix_checksum8(u8* packet, u16 size)
+/* sets a class's rate limit, and fills its bucket. Called with
+ * req_lock held. */
+static void lj_sched_limit(struct lj_sched *sch, u32 rate, u32 burst)
 {
-	u16 acc = 0;
-	u16 i;
-	for( i = 1; i < size; i++){
-		acc += packet[i];
-	}
-	acc = (acc & 0xff) + (acc >> 8);
-	acc = (acc & 0xff) + (acc >> 8);
-	
-	*packet = (u8)(acc & 0xff);
+	sch->rate = rate;
+	sch->burst = burst;
+	sch->cost_ns = rate ? NSEC_PER_SEC / rate : 0;
+	sch->credit_ns = sch->cost_ns * burst;
+	sch->last_ns = ktime_get_ns();
 }
 
-static int insert_state_table(struct lj_state *state)
+/* adds the credit a class has built up since last time, up to its
+ * burst */
+static void lj_sched_refill(struct lj_sched *sch, u64 now)
 {
-	int i;
-	
-	mutex_lock(&state_table_lock);
-	
-	for(i = 0; i < MAXDEV; i++){
-		if(!lj_state_table[i]){
-			lj_state_table[i] = state;
-			mutex_unlock(&state_table_lock);
-			return i*LJ_NUM_MINORS + MINOR_START;
-		}
-	}
-	/* if we have gotten here, there is no more room to register a
-	 * device. */
-	mutex_unlock(&state_table_lock);
-	return -1;
-  
+	if(!sch->rate)
+		return;
+	sch->credit_ns += now - sch->last_ns;
+	sch->last_ns = now;
+	if(sch->credit_ns > (s64)(sch->cost_ns * sch->burst))
+		sch->credit_ns = sch->cost_ns * sch->burst;
 }
 
-static int remove_state_table(int minor)
+static int lj_sched_ready(struct lj_sched *sch)
 {
-	/* this gives us an integer that is an index into the interface
-	   table based on the minor number used. */
-	int index = (minor - MINOR_START) / LJ_NUM_MINORS;
-	if(index >= MAXDEV){
-		printk(KERN_INFO 
-			"someone passed in an invalid minor number: %d\n",
-			minor);
-		return -1;
+	return !sch->rate || sch->credit_ns > 0;
+}
+
+/* picks the class the next packet is for: the first with requests
+ * waiting and credit left, or if none have credit, the first with
+ * requests waiting, so the pipe never idles. Returns -1 if nothing is
+ * waiting. Called with req_lock held. */
+static int lj_sched_pick(struct lj_state *state)
+{
+	struct lj_sched *sch;
+	u64 now = ktime_get_ns();
+	int first = -1;
+	int prio;
+
+	for(prio = 0; prio < LJ_NUM_PRIO; prio++){
+		sch = &state->sched[prio];
+		if(list_empty(&sch->queue))
+			continue;
+		lj_sched_refill(sch, now);
+		if(lj_sched_ready(sch))
+			break;
+		if(first < 0)
+			first = prio;
 	}
-	mutex_lock(&state_table_lock);
-	if(lj_state_table[index] == NULL){
-		printk(KERN_INFO "device is already NULL! cannot remove from" 
-			"interface table.\n");
-		mutex_unlock(&state_table_lock);
-		return -1;
+	if(prio == LJ_NUM_PRIO)
+		return first;
+
+	/* the classes before it were passed over */
+	while(first >= 0 && first < prio){
+		if(!list_empty(&state->sched[first].queue))
+			state->sched[first].throttled++;
+		first++;
 	}
-	lj_state_table[index] = NULL;
-	mutex_unlock(&state_table_lock);
-	return 0;  
+	return prio;
 }
 
-static struct lj_state* get_lj_state(int minor)
+/* moves a request from its class's queue into the transfer, charging
+ * the class for it */
+static void lj_sched_take(struct lj_state *state, struct lj_xfer *xfer,
+			struct lj_req *req, u64 now)
 {
-	/* this gives us an integer that is an index into the interface
-	   table based on the minor number used. */
-	int index = (minor - MINOR_START) / LJ_NUM_MINORS;
-	struct lj_state *state;
-	if(index >= MAXDEV){
-		printk(KERN_INFO 
-			"someone passed in an invalid minor number: %d\n",
-			minor);
-		return NULL;
-	}
-	mutex_lock(&state_table_lock);
-	state = lj_state_table[index]; 
-	mutex_unlock(&state_table_lock);
-	return state;
+	struct lj_sched *sch = &state->sched[req->prio];
+	u64 wait = now - ktime_to_ns(req->start);
+
+	list_move_tail(&req->list, &xfer->batch);
+	sch->depth--;
+	sch->sent++;
+	sch->wait_ns_total += wait;
+	if(wait > sch->wait_ns_max)
+		sch->wait_ns_max = wait;
+	/* served with nothing else waiting, it shouldn't run up a debt */
+	if(sch->rate && sch->credit_ns > -(s64)sch->cost_ns)
+		sch->credit_ns -= sch->cost_ns;
 }
 
-static void fix_checksum16(u8* packet, u16 size)
+/* packs Feedback requests from the head of one class's queue. Keeps
+ * the class in order: stops at the first request that does not fit,
+ * or at a raw request. */
+static void lj_pack_queue(struct lj_state *state, struct lj_xfer *xfer,
+			int prio, int *cmdlen, int *rcvlen, int *count, u64 now)
 {
-	int i;
-	u16 acc = 0;
-	for (i = 6; i < size; i++){
-		acc += packet[i];
+	struct lj_req *req, *tmp, *first;
+
+	list_for_each_entry_safe(req, tmp, &state->sched[prio].queue, list){
+		if(req->flags & LJ_REQ_RAW)
+			break;
+		if(*cmdlen + req->cmd_len > LJ_MAX_PACKET ||
+			*rcvlen + req->resp_len > LJ_MAX_PACKET)
+			break;
+		/* a response length we can't vouch for would shift every
+		 * response after it, so keep it among its own */
+		if(*count){
+			first = list_first_entry(&xfer->batch, struct lj_req,
+						list);
+			if(((req->flags | first->flags) & LJ_REQ_OWN) &&
+				req->context != first->context)
+				break;
+		}
+		memcpy(xfer->snd_packet + *cmdlen, req->cmd, req->cmd_len);
+		*cmdlen += req->cmd_len;
+		*rcvlen += req->resp_len;
+		lj_sched_take(state, xfer, req, now);
+		(*count)++;
 	}
-	packet[4] = (u8)(acc & 0xff);
-	packet[5] = (u8)(acc >> 8);
-
-	fix_checksum8(packet, 6);
-
 }
 
-static void c_urb_in_cbk(struct urb *urb)
+/* packs the requests at the head of class prio's queue into the
+ * transfer: either one raw request, or as many Feedback IOTypes as fit
+ * in a 64 byte command and response. Room left over goes to the other
+ * classes with credit, in order. Called with req_lock held. */
+static void lj_pack(struct lj_state *state, struct lj_xfer *xfer, int prio)
 {
-	int rawvoltage;
-	u8 *rcv_packet;
-	struct lj_state *curstate;
+	struct lj_req *req;
+	u8 *snd_packet = xfer->snd_packet;
+	u64 now = ktime_get_ns();
+	int cmdlen = 7;		/* header and echo byte */
+	int rcvlen = 9;		/* header, errorcode, errorframe, echo */
+	int count = 0;
+	int i;
 
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in portc IN cbk.\n");
-		/* for some reason we got shutdown. abort. */
-		return;
-	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in portc urb IN cbk: %d.\n", 
-			urb->status);
+	req = list_first_entry(&state->sched[prio].queue, struct lj_req, list);
+	if(req->flags & LJ_REQ_RAW){
+		lj_sched_take(state, xfer, req, now);
+		memcpy(snd_packet, req->cmd, req->cmd_len);
+		lj_fill_out(xfer, req->cmd_len, lj_xfer_out_cbk);
+		xfer->rcv_size = req->resp_len;
+		xfer->raw = 1;
+		xfer->nreqs = 1;
 		return;
 	}
-	if (was_err(urb->transfer_buffer, urb->actual_length))
-	{
-		printk(KERN_INFO "There was a checksum error!\n");
-		goto error;
-	}
 
-	rcv_packet = (u8*)urb->transfer_buffer;
-	
-	if (rcv_packet[6]){
-		printk(KERN_INFO "There was an error: %d\n", rcv_packet[6]);
-		goto error;
+	lj_pack_queue(state, xfer, prio, &cmdlen, &rcvlen, &count, now);
+	for(i = 0; i < LJ_NUM_PRIO; i++){
+		if(i != prio && lj_sched_ready(&state->sched[i]))
+			lj_pack_queue(state, xfer, i, &cmdlen, &rcvlen,
+					&count, now);
 	}
 
+	/* both directions are sent as whole words */
+	if(cmdlen & 1)
+		snd_packet[cmdlen++] = 0;
+	if(rcvlen & 1)
+		rcvlen++;
 
-	curstate = (struct lj_state*)urb->context;
+	xfer->raw = 0;
+	xfer->echo = lj_next_echo(state);
 
-	printk(KERN_INFO "Successfully submitted portC IN URB\n");
-	
-	rawvoltage = rcv_packet[9] + (rcv_packet[10] << 8);
+	/* 8bit checksum */
+	snd_packet[1] = 0xf8;
+	snd_packet[2] = (cmdlen - 6) / 2;
+	snd_packet[3] = 0x00;
+	/* 16bit checksum */
+	snd_packet[6] = xfer->echo;	/* comes back in the response */
+	fix_checksum16(snd_packet, cmdlen);
+
+	lj_fill_out(xfer, cmdlen, lj_xfer_out_cbk);
+	xfer->rcv_size = rcvlen;
+	xfer->nreqs = count;
+	state->fb_packets++;
+	state->fb_reqs += count;
+}
 
-	if(rawvoltage > 26860){
-		printk(KERN_INFO "EIN2 greater than 1V\n");
-		curstate->airlock = air_open;
-		wake_up_interruptible(&curstate->c_waitqueue);
+/* sends queued requests while there is room in the pipeline, most
+ * urgent class first. Raw commands have no echo byte, so they wait
+ * for the pipeline to empty and then go out on their own. */
+static void lj_req_kick(struct lj_state *state)
+{
+	struct lj_xfer *xfer;
+	struct lj_req *req;
+	unsigned long flags;
+	int result;
+	int prio;
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	while(!state->req_dead && !state->req_barrier &&
+		state->req_ninflight < LJ_MAX_INFLIGHT){
+
+		prio = lj_sched_pick(state);
+		if(prio < 0)
+			break;
+		req = list_first_entry(&state->sched[prio].queue,
+				struct lj_req, list);
+		if((req->flags & LJ_REQ_RAW) && state->req_ninflight)
+			break;
+
+		xfer = lj_xfer_get(state);
+		if(!xfer)
+			break;	/* kicked again when a transfer comes back */
+
+		lj_pack(state, xfer, prio);
+		xfer->phase = LJ_XFER_OUT;
+		xfer->start = jiffies;
+		list_add_tail(&xfer->inflight, &state->req_inflight);
+		state->req_ninflight++;
+		if(state->req_ninflight > state->req_max_inflight)
+			state->req_max_inflight = state->req_ninflight;
+		if(xfer->raw)
+			state->req_barrier = 1;
+
+		if(!timer_pending(&state->req_timer))
+			mod_timer(&state->req_timer, jiffies + LJ_CMD_TIMEOUT);
+
+		trace_lj_xfer_send(state->devid, xfer->echo, xfer->raw,
+				xfer->nreqs, xfer->urb->transfer_buffer_length);
+		result = usb_submit_urb(xfer->urb, GFP_ATOMIC);
+		if(result){
+			printk(KERN_INFO "Could not submit feedback urb: %d\n",
+				result);
+			spin_unlock_irqrestore(&state->req_lock, flags);
+			lj_xfer_finish(xfer, result);
+			return;
+		}
 	}
-	else{
-		printk(KERN_INFO "EIN2 less than 1V\n");
-		curstate->airlock = air_closed;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+}
+
+/* works out which histogram a request belongs in */
+static int lj_req_kind(const struct lj_req *req)
+{
+	if(req->flags & LJ_REQ_RAW){
+		/* extended commands carry their number in byte 3 */
+		if(req->cmd[1] == 0xf8 && req->cmd[3] == 0x0b)
+			return LJ_KIND_CONFIG_IO;
+		return LJ_KIND_RAW;
 	}
-	
-error:
-	kfree(urb->transfer_buffer);
-	usb_free_urb(urb);
-	return;
+	switch(req->cmd[0]){
+	case 1:
+		return req->cmd[1] == 30 ? LJ_KIND_TEMP : LJ_KIND_AIN;
+	case 11:
+		return LJ_KIND_BIT_WRITE;
+	}
+	return LJ_KIND_FEEDBACK;
+}
 
+/* counts a finished request in this CPU's latency histogram */
+static void lj_req_account(struct lj_state *state, struct lj_req *req)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), req->start));
+	int bucket = min_t(int, fls64(div_u64(ns, NSEC_PER_USEC)),
+			LJ_HIST_BUCKETS - 1);
+
+	this_cpu_inc(state->stats->latency[req->kind][bucket]);
+	if(req->result < 0)
+		this_cpu_inc(state->stats->errors[req->kind]);
+	trace_lj_req_done(state->devid, req->kind, req->result, ns);
 }
 
-static void c_urb_out_cbk(struct urb *urb)
+/* hands the response in the transfer out to each request in its
+ * batch, takes it out of the pipeline and sends whatever queued up
+ * meanwhile. status is 0 if rcv_packet holds a response. */
+static void lj_xfer_finish(struct lj_xfer *xfer, int status)
 {
-	u8 *rcv_packet;
-	struct lj_state *curstate;
-	const int RCVSIZE = 12;
-	int result;
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in portc callback.\n");
-		/* for some reason we got shutdown. abort. */
-		return;
+	struct lj_state *state = xfer->state;
+	struct lj_req *req, *tmp;
+	u8 *rcv_packet = xfer->rcv_packet;
+	int offset = 9;
+	int frame = 0;
+	int errframe = -1;
+	unsigned long flags;
+	LIST_HEAD(done);
+	LIST_HEAD(retry);
+
+	trace_lj_xfer_done(state->devid, xfer->echo, status, xfer->rcv_len);
+
+	if(!status && xfer->raw){
+		req = list_first_entry(&xfer->batch, struct lj_req, list);
+		req->result = min(xfer->rcv_len, req->resp_len);
+		memcpy(req->resp, rcv_packet, req->result);
+		goto out;
 	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in portc urb out cbk: %d.\n", 
+
+	if(!status && (xfer->rcv_len < 9 || rcv_packet[1] != 0xf8)){
+		printk(KERN_INFO "short feedback response\n");
+		status = -EIO;
+	}
+	else if(!status && rcv_packet[6]){
+		/* the U3 ran every IOType before the error frame and
+		 * returned their data, then stopped */
+		printk(KERN_INFO "error %d in feedback frame %d\n",
+			rcv_packet[6], rcv_packet[7]);
+		errframe = rcv_packet[7];
+	}
+	else if(!status && xfer->rcv_len < xfer->rcv_size){
+		printk(KERN_INFO "short feedback response\n");
+		status = -EIO;
+	}
+
+	list_for_each_entry_safe(req, tmp, &xfer->batch, list){
+		if(status){
+			req->result = status;
+		}
+		else if(errframe >= 0 && frame > errframe){
+			/* never ran, so it can safely go again */
+			list_move_tail(&req->list, &retry);
+		}
+		else if(errframe >= 0 && frame + max(req->frames, 1) > errframe){
+			req->result = -EIO;
+		}
+		else if(offset + req->resp_len > xfer->rcv_len){
+			req->result = -EIO;
+		}
+		else{
+			memcpy(req->resp, rcv_packet + offset, req->resp_len);
+			offset += req->resp_len;
+			req->result = 0;
+		}
+		frame += max(req->frames, 1);
+	}
+
+out:
+	spin_lock_irqsave(&state->req_lock, flags);
+	if(state->req_dead){
+		/* lj_req_drain has already emptied the queues, so nothing
+		 * would ever complete them there */
+		list_for_each_entry(req, &retry, list)
+			req->result = -ENODEV;
+		list_splice_tail_init(&retry, &xfer->batch);
+	}
+	/* back to the head of their queues, in order */
+	list_for_each_entry_safe_reverse(req, tmp, &retry, list){
+		list_move(&req->list, &state->sched[req->prio].queue);
+		state->sched[req->prio].depth++;
+	}
+	list_for_each_entry(req, &xfer->batch, list)
+		req->flags &= ~LJ_REQ_PENDING;
+	list_splice_init(&xfer->batch, &done);
+	if(!list_empty(&xfer->inflight))
+		list_del_init(&xfer->inflight);
+	state->req_ninflight--;
+	if(xfer->raw)
+		state->req_barrier = 0;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+
+	lj_xfer_put(xfer);
+
+	list_for_each_entry_safe(req, tmp, &done, list){
+		list_del_init(&req->list);
+		/* the request may be gone once done returns */
+		lj_req_account(state, req);
+		req->done(req);
+	}
+
+	lj_req_kick(state);
+}
+
+/* a raw command's response starts with its command byte plus one,
+ * or for extended commands, echoes the command number. */
+static int lj_raw_match(struct lj_xfer *xfer, u8 *rcv_packet, int len)
+{
+	u8 *snd_packet = xfer->snd_packet;
+
+	if(snd_packet[1] == 0xf8)
+		return len >= 4 && rcv_packet[1] == 0xf8 &&
+			rcv_packet[3] == snd_packet[3];
+	return len >= 2 && rcv_packet[1] == (u8)(snd_packet[1] + 1);
+}
+
+/* finds the transfer in flight that a response belongs to. Feedback
+ * responses carry their echo byte. A bad checksum reply carries
+ * nothing, so it goes to the oldest transfer still waiting. Called
+ * with req_lock held. */
+static struct lj_xfer *lj_match_response(struct lj_state *state,
+					u8 *rcv_packet, int len)
+{
+	struct lj_xfer *xfer;
+	int bad_checksum = was_err(rcv_packet, len);
+
+	list_for_each_entry(xfer, &state->req_inflight, inflight){
+		if(xfer->phase != LJ_XFER_WAIT)
+			continue;
+		if(bad_checksum)
+			return xfer;
+		if(xfer->raw){
+			if(lj_raw_match(xfer, rcv_packet, len))
+				return xfer;
+		}
+		else if(len >= 9 && rcv_packet[1] == 0xf8 &&
+			rcv_packet[3] == 0x00 && rcv_packet[8] == xfer->echo){
+			return xfer;
+		}
+	}
+	return NULL;
+}
+
+/* queues a transfer on EP2 to catch the next response. */
+static void lj_rx_post(struct lj_state *state)
+{
+	struct lj_xfer *rx;
+	unsigned long flags;
+
+	rx = lj_xfer_get(state);
+	if(rx){
+		lj_fill_in(rx, LJ_MAX_PACKET, lj_rx_cbk);
+		if(!usb_submit_urb(rx->urb, GFP_ATOMIC))
+			return;
+		lj_xfer_put(rx);
+	}
+
+	/* the watchdog fails whatever was waiting on this response */
+	spin_lock_irqsave(&state->req_lock, flags);
+	state->rx_posted--;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+}
+
+/* a response came in on EP2. Responses come back in the order the
+ * commands went out, but matching them by echo byte means a lost or
+ * late response can't shift every later one onto the wrong request. */
+static void lj_rx_cbk(struct urb *urb)
+{
+	struct lj_xfer *rx = urb->context;
+	struct lj_state *state = rx->state;
+	struct lj_xfer *owner = NULL;
+	unsigned long flags;
+	int repost = 0;
+
+	if(!urb->status)
+		this_cpu_add(state->stats->bytes_in, urb->actual_length);
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	state->rx_posted--;
+	if(!urb->status){
+		owner = lj_match_response(state, rx->rcv_packet,
+					urb->actual_length);
+		if(owner){
+			list_del_init(&owner->inflight);
+			state->rx_awaiting--;
+		}
+		else{
+			state->req_stray++;
+		}
+	}
+	/* after an error, the next command sent posts a new IN urb */
+	if(!urb->status && !state->req_dead &&
+		state->rx_posted < state->rx_awaiting){
+		state->rx_posted++;
+		repost = 1;
+	}
+	spin_unlock_irqrestore(&state->req_lock, flags);
+
+	if(urb->status)
+		printk(KERN_INFO "Error in feedback urb in cbk: %d.\n",
+			urb->status);
+
+	if(owner){
+		memcpy(owner->rcv_packet, rx->rcv_packet, urb->actual_length);
+		owner->rcv_len = urb->actual_length;
+		if(was_err(owner->rcv_packet, owner->rcv_len)){
+			printk(KERN_INFO "bad checksum in feedback response!\n");
+			this_cpu_inc(state->stats->checksum_errors);
+			lj_xfer_finish(owner, -EIO);
+		}
+		else{
+			lj_xfer_finish(owner, 0);
+		}
+	}
+
+	lj_xfer_put(rx);
+	if(repost)
+		lj_rx_post(state);
+	lj_req_kick(state);
+}
+
+static void lj_xfer_out_cbk(struct urb *urb)
+{
+	struct lj_xfer *xfer = urb->context;
+	struct lj_state *state = xfer->state;
+	unsigned long flags;
+	int post = 0;
+
+	if(urb->status){
+		printk(KERN_INFO "Error in feedback urb out cbk: %d.\n",
 			urb->status);
+		lj_xfer_finish(xfer, urb->status);
 		return;
 	}
-	
-	/* if we are here, we are go for an in URB */
-	printk(KERN_INFO "Successfully submitted portC OUT URB\n");
-	curstate = (struct lj_state*)urb->context;
-	
-	rcv_packet = kmalloc(sizeof(u8)*RCVSIZE, GFP_ATOMIC);
 
-	
-	kfree(urb->transfer_buffer);
-	usb_fill_bulk_urb(urb, curstate->usb_device, 
-			usb_rcvbulkpipe(curstate->usb_device, 2), 
-			rcv_packet, RCVSIZE, c_urb_in_cbk, curstate);
-	
-	/* submit the urb */
-	result = usb_submit_urb(urb, GFP_ATOMIC);
-	WARN_ON(result);
-	return;
+	this_cpu_add(state->stats->bytes_out, urb->actual_length);
+
+	/* the command is on the device. Make sure there is an IN urb
+	 * waiting for every response we expect. */
+	spin_lock_irqsave(&state->req_lock, flags);
+	xfer->phase = LJ_XFER_WAIT;
+	state->rx_awaiting++;
+	if(state->rx_posted < state->rx_awaiting){
+		state->rx_posted++;
+		post = 1;
+	}
+	spin_unlock_irqrestore(&state->req_lock, flags);
+
+	if(post)
+		lj_rx_post(state);
 }
 
-static void a_timer_cbk(unsigned long state)
+/* fails transfers that have been in flight for longer than
+ * LJ_CMD_TIMEOUT, so nobody waits forever on a lost response. */
+static void lj_req_timeout(unsigned long data)
 {
-	
-	struct lj_state *curstate = (struct lj_state*)state;
-	
-	/* get exclusive access to the portA bits of curstate */
-	spin_lock(curstate->a_lock);
-	
-	/* invert the state of fio4 */
-	curstate->fio4_state = curstate->fio4_state ? 0 : 1;
+	struct lj_state *state = (struct lj_state*)data;
+	struct lj_xfer *xfer, *tmp;
+	struct urb *stuck[LJ_MAX_INFLIGHT];
+	int nstuck = 0;
+	unsigned long flags;
+	int i;
+	LIST_HEAD(expired);
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	list_for_each_entry_safe(xfer, tmp, &state->req_inflight, inflight){
+		if(time_before(jiffies, xfer->start + LJ_CMD_TIMEOUT))
+			continue;
+		if(xfer->phase == LJ_XFER_WAIT){
+			list_move_tail(&xfer->inflight, &expired);
+			state->rx_awaiting--;
+		}
+		else if(nstuck < LJ_MAX_INFLIGHT){
+			/* still sending. Its out callback finishes it once
+			 * the unlink goes through. */
+			stuck[nstuck++] = xfer->urb;
+		}
+		state->req_timeouts++;
+	}
+	if(!list_empty(&state->req_inflight) && !state->req_dead)
+		mod_timer(&state->req_timer, jiffies + LJ_CMD_TIMEOUT);
+	spin_unlock_irqrestore(&state->req_lock, flags);
 
-	set_fio4_lvl(curstate, curstate->fio4_state);
-	
-	/* if we freq is nonzero, submit again */
-	if(curstate->a_freq){
-		curstate->a_poll_timer.expires = jiffies + curstate->a_freq*HZ;
-		add_timer(&curstate->a_poll_timer);
+	for(i = 0; i < nstuck; i++)
+		usb_unlink_urb(stuck[i]);
+
+	list_for_each_entry_safe(xfer, tmp, &expired, inflight){
+		list_del_init(&xfer->inflight);
+		lj_xfer_finish(xfer, -ETIMEDOUT);
 	}
-	/* give up exclusive access. */
-	spin_unlock(curstate->a_lock);
 }
 
+/* queues a request for the labjack, in class req->prio, without
+ * kicking the pipe. Lets a caller queue several requests that should
+ * go out together. Returns -EBUSY if the request is still pending from
+ * an earlier submit. Safe from atomic context. */
+static int lj_req_queue(struct lj_state *state, struct lj_req *req)
+{
+	struct lj_sched *sch;
+	unsigned long flags;
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	if(state->req_dead){
+		spin_unlock_irqrestore(&state->req_lock, flags);
+		return -ENODEV;
+	}
+	if(req->flags & LJ_REQ_PENDING){
+		spin_unlock_irqrestore(&state->req_lock, flags);
+		return -EBUSY;
+	}
+	req->flags |= LJ_REQ_PENDING;
+	req->kind = lj_req_kind(req);
+	req->start = ktime_get();
+	sch = &state->sched[req->prio];
+	list_add_tail(&req->list, &sch->queue);
+	if(++sch->depth > sch->max_depth)
+		sch->max_depth = sch->depth;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+	trace_lj_req_submit(state->devid, req->kind, req->cmd);
+	return 0;
+}
 
-static void c_timer_cbk(unsigned long state)
+/* queues a request for the labjack and sends it as soon as the pipe
+ * has room */
+static int lj_req_submit(struct lj_state *state, struct lj_req *req)
 {
-	struct lj_state *curstate = (struct lj_state*)state;
+	int result;
 
-	const int SNDSIZE = 10;
-	u8 *snd_packet = NULL;
-	
+	result = lj_req_queue(state, req);
+	if(result)
+		return result;
+	lj_req_kick(state);
+	return 0;
+}
+
+static void lj_req_wake(struct lj_req *req)
+{
+	complete(req->context);
+}
+
+/* sends a request in class prio and waits for it to complete. Must
+ * be called from process context. The watchdog bounds the wait. */
+static int lj_req_sync(struct lj_state *state, struct lj_req *req, int prio)
+{
+	struct completion done;
+	int result;
+
+	init_completion(&done);
+	req->flags &= LJ_REQ_RAW;
+	req->prio = prio;
+	req->done = lj_req_wake;
+	req->context = &done;
+
+	result = lj_req_submit(state, req);
+	if(result)
+		return result;
+
+	wait_for_completion(&done);
+	return req->result;
+}
+
+struct lj_batch {
+	atomic_t left;
+	struct completion done;
+};
+
+static void lj_batch_done(struct lj_req *req)
+{
+	struct lj_batch *batch = req->context;
+
+	if(atomic_dec_and_test(&batch->left))
+		complete(&batch->done);
+}
+
+/* sends several Feedback requests in class prio at once, so they can
+ * share packets, and waits for all of them. They are all queued before
+ * the pipe is kicked, or the first few would each go out alone. Must
+ * be called from process context. Returns the first error any of them
+ * got. */
+static int lj_req_sync_batch(struct lj_state *state, struct lj_req *reqs,
+			int count, int prio)
+{
+	struct lj_batch batch;
 	int result = 0;
-	struct urb *urb;
-	
+	int i;
 
-	printk(KERN_INFO "portC polling timer triggered!\n");
-	snd_packet = kzalloc(sizeof(u8)*SNDSIZE, GFP_ATOMIC);
-	if(!snd_packet){
-		printk(KERN_INFO "Could not allocate memory for snd_packet"
-			" for portC.\n");
-		return;
+	atomic_set(&batch.left, count + 1);
+	init_completion(&batch.done);
+
+	for(i = 0; i < count; i++){
+		/* callers set LJ_REQ_OWN themselves */
+		reqs[i].flags &= LJ_REQ_OWN;
+		reqs[i].prio = prio;
+		reqs[i].done = lj_batch_done;
+		reqs[i].context = &batch;
+		reqs[i].result = lj_req_queue(state, &reqs[i]);
+		if(reqs[i].result)
+			atomic_dec(&batch.left);
 	}
+	lj_req_kick(state);
+	if(!atomic_dec_and_test(&batch.left))
+		wait_for_completion(&batch.done);
 
-	/* 8bit checksum */
-	snd_packet[1] = 0xf8;
-	snd_packet[2] = 0x2; 		/* number of words is .5 + 1.5 */
-	snd_packet[3] = 0x00;
-	/* 16bit checksum */
-	snd_packet[6] = 0x00;		/* echo can be whatever we want */
-	snd_packet[7] = 0x01;		/* Do an analog in */
-	snd_packet[8] = 10;		/* read AIN10 */
-	snd_packet[9] = 31;		/* compare it to gnd */
+	for(i = 0; i < count && !result; i++)
+		result = reqs[i].result;
+	return result;
+}
+
+/* fails every queued and in flight request. Called when the hardware
+ * goes away. */
+static void lj_req_drain(struct lj_state *state)
+{
+	struct lj_req *req, *tmp;
+	struct lj_xfer *xfer, *xtmp;
+	unsigned long flags;
+	int i;
+	LIST_HEAD(done);
+	LIST_HEAD(waiting);
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	state->req_dead = 1;
+	for(i = 0; i < LJ_NUM_PRIO; i++){
+		list_splice_tail_init(&state->sched[i].queue, &done);
+		state->sched[i].depth = 0;
+	}
+	list_for_each_entry(req, &done, list)
+		req->flags &= ~LJ_REQ_PENDING;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+
+	list_for_each_entry_safe(req, tmp, &done, list){
+		list_del_init(&req->list);
+		req->result = -ENODEV;
+		req->done(req);
+	}
 
-	fix_checksum16(snd_packet, SNDSIZE);
+	/* killing the urbs finishes anything still sending */
+	del_timer_sync(&state->req_timer);
+	for(i = 0; i < LJ_POOL_SIZE; i++){
+		if(state->pool[i].urb)
+			usb_kill_urb(state->pool[i].urb);
+	}
 
-	
-	urb = usb_alloc_urb(0, GFP_ATOMIC);
-	urb->transfer_flags = 0;
-	usb_fill_bulk_urb(urb, curstate->usb_device, 
-			usb_sndbulkpipe(curstate->usb_device, 1), 
-			snd_packet, SNDSIZE, c_urb_out_cbk, curstate);
+	/* whatever is left was waiting on a response that won't come */
+	spin_lock_irqsave(&state->req_lock, flags);
+	list_splice_init(&state->req_inflight, &waiting);
+	spin_unlock_irqrestore(&state->req_lock, flags);
 
-	result = usb_submit_urb(urb, GFP_ATOMIC);
-	WARN_ON(result);
-	
-	/* set up the next interrupt */
-	curstate->c_poll_timer.expires += LJ_PORTC_FREQ;
-	add_timer(&curstate->c_poll_timer);
-	return;
+	list_for_each_entry_safe(xfer, xtmp, &waiting, inflight){
+		list_del_init(&xfer->inflight);
+		lj_xfer_finish(xfer, -ENODEV);
+	}
 }
 
-static  int lj_probe(struct usb_interface *intf, const struct usb_device_id *id)
+/* the status page is updated from completion handlers and timers, so
+ * writers take status_lock, and make seq odd while they write */
+static void lj_status_begin(struct lj_state *state, unsigned long *flags)
 {
-  
-	struct usb_device *usb_device;
-  
-	struct lj_state *curstate = NULL;
+	spin_lock_irqsave(&state->status_lock, *flags);
+	state->status->seq++;
+	smp_wmb();
+}
 
-	int result;
-	const int CFGSIZE = 12;
-	const int RCVSIZE = 12;
-	const int DIGSIZE = 10;
-	const int DIGRCVSIZE = 10;
-	u8 config_packet[CFGSIZE];
-	u8 rcv_packet[RCVSIZE];
-	u8 dig_packet[DIGSIZE];
-	u8 digrcv_packet[DIGRCVSIZE];
-	int sent_len;
-	int minor;
-	int devid;
-	char *tmpname = NULL;
-	/* 8bit checksum */
-	config_packet[1] = 0xf8; 	/* ConfigIO packet */
-	config_packet[2] = 0x03;
-	config_packet[3] = 0x0b;
-	/* 16bit checksum */
-	config_packet[6] = 15;	/* set everything */
-	config_packet[7] = 0x00;	/* reserved */
-	config_packet[8] = 0x40;	/* offset must be at least 4*/
-	config_packet[9] = 0x00;	/* deprecated */
-	config_packet[10] = 0x00;	/* no Analog on FIO */
-	config_packet[11] = 0x04;	/* EIO2 is AIN10 */
- 
-	fix_checksum16(config_packet, CFGSIZE);
+static void lj_status_end(struct lj_state *state, unsigned long *flags)
+{
+	smp_wmb();
+	state->status->seq++;
+	spin_unlock_irqrestore(&state->status_lock, *flags);
+}
 
+static void lj_status_temp(struct lj_state *state, int temp, u64 ns)
+{
+	unsigned long flags;
 
-	/* configure the packet to set FIO4 as output */
+	lj_status_begin(state, &flags);
+	state->status->temp = temp;
+	state->status->temp_ns = ns;
+	state->status->temp_count++;
+	lj_status_end(state, &flags);
+}
 
-	/* 8bit checksum */
-	dig_packet[1] = 0xf8;
-	dig_packet[2] = 0x2; 		/* number of words is .5 + 1.5 */
-	dig_packet[3] = 0x00;
-	/* 16bit checksum */
-	dig_packet[6] = 0x00;		/* echo can be whatever we want */
-	dig_packet[7] = 13;		/* Do a digital dir set */
-	dig_packet[8] = 0x84;		/* set FIO4 as output */
-	dig_packet[9] = 00;		/* padding*/
+static void lj_status_airlock(struct lj_state *state)
+{
+	unsigned long flags;
 
-	fix_checksum16(dig_packet, DIGSIZE);
+	lj_status_begin(state, &flags);
+	state->status->airlock = state->airlock;
+	state->status->airlock_ns = ktime_get_ns();
+	state->status->airlock_count++;
+	lj_status_end(state, &flags);
+}
 
+static void lj_status_fio4(struct lj_state *state, int lvl)
+{
+	unsigned long flags;
 
-	printk(KERN_INFO "You were probed!!!\n");
+	lj_status_begin(state, &flags);
+	state->status->fio4_state = lvl;
+	state->status->fio4_ns = ktime_get_ns();
+	state->status->fio4_count++;
+	lj_status_end(state, &flags);
+}
 
-	curstate = kzalloc(sizeof(struct lj_state), GFP_KERNEL);
-  
-	if(!curstate){
-		printk( KERN_INFO 
-			"Could not allocate memory for labjack state!!!\n");
-		goto error;
+/* publishes portA's period. When Timer0 is driving fio4, fio4_ns is
+ * when it started, and readers work the edges out from the period. */
+static void lj_status_porta(struct lj_state *state)
+{
+	unsigned long flags;
+
+	lj_status_begin(state, &flags);
+	state->status->a_period_us = state->a_period_us;
+	if(state->a_hw){
+		state->status->fio4_ns = state->a_hw_start;
+		state->status->fio4_count++;
 	}
-  
-	usb_device = interface_to_usbdev(intf);
-  
-	curstate->usb_device = usb_device;
+	lj_status_end(state, &flags);
+}
 
+/* fio4_req completed. If someone asked for another level while it was
+ * pending, send that too. */
+static void fio4_req_done(struct lj_req *req)
+{
+	struct lj_state *curstate = req->context;
 
-	curstate->a_lock = kmalloc(sizeof(spinlock_t), GFP_KERNEL);
-	if(!curstate->a_lock)
-	{
-		printk(KERN_INFO 
-			"Could not allocate memory for hardware mutex!\n");
-		goto err_free;
+	if(req->result)
+		printk(KERN_INFO "error setting fio4: %d\n", req->result);
+
+	if(((req->cmd[1] >> 7) & 1) != curstate->fio4_want)
+		set_fio4_lvl(curstate, curstate->fio4_want);
+}
+
+static void set_fio4_lvl (struct lj_state *state, int lvl)
+{
+	struct lj_req *req = &state->fio4_req;
+	int result;
+
+
+	state->fio4_want = lvl;
+	lj_status_fio4(state, lvl);
+
+	/* if the last level is still pending, fio4_req_done sends this
+	 * one once it completes. */
+	if(req->flags & LJ_REQ_PENDING)
+		return;
+
+	req->cmd[0] = 11;		/* Do a digital set */
+	req->cmd[1] = (lvl << 7) + 4;	/* set FIO4 to: lvl */
+	req->cmd_len = 2;
+	req->resp_len = 0;
+	req->prio = LJ_PRIO_OUTPUT;
+	req->done = fio4_req_done;
+	req->context = state;
+
+	result = lj_req_submit(state, req);
+	if(result && result != -EBUSY)
+		printk(KERN_INFO "Could not set fio4: %d\n", result);
+}
+
+/* debug function to print an array to /var/log/messages. This is done
+   using */
+static void print_arr(u8* data, int size)
+{
+	int i;
+	printk("[ ");
+	for(i = 0; i < size - 1; i++)
+		printk("0x%x, ", data[i]);
+	printk("0x%x ]", data[size - 1]);
+}
+
+static void fix_checksum8(u8* packet, u16 size)
+{
+	u16 acc = 0;
+	u16 i;
+	for( i = 1; i < size; i++){
+		acc += packet[i];
 	}
+	acc = (acc & 0xff) + (acc >> 8);
+	acc = (acc & 0xff) + (acc >> 8);
 	
-	
-	curstate->hw_lock = NULL;
-	
+	*packet = (u8)(acc & 0xff);
+}
 
-	curstate->hw_lock = kmalloc(sizeof(spinlock_t), GFP_KERNEL);
-  
-	if(curstate->hw_lock == NULL){
-		printk(KERN_INFO 
-			"Could not allocate memory for hardware mutex!\n");
-		goto err_alock;
+/* frees a labjack once it is disconnected and the last file on it is
+ * closed */
+static void lj_state_release(struct kref *kref)
+{
+	struct lj_state *state = container_of(kref, struct lj_state, kref);
+
+	free_percpu(state->stats);
+	free_page((unsigned long)state->status);
+	kfree(state->out_ring);
+	usb_put_dev(state->usb_device);
+	/* chr_open may still be looking at it under rcu_read_lock */
+	kfree_rcu(state, rcu);
+}
+
+static void lj_state_put(struct lj_state *state)
+{
+	kref_put(&state->kref, lj_state_release);
+}
+
+/* makes a registered char device findable by chr_open. If that fails,
+ * the device is deregistered again. */
+static int lj_add_minor(struct lj_state *state, struct miscdevice *misc)
+{
+	int result;
+
+	mutex_lock(&lj_idr_lock);
+	result = idr_alloc(&lj_minor_idr, state, misc->minor, misc->minor + 1,
+			GFP_KERNEL);
+	mutex_unlock(&lj_idr_lock);
+	if(result < 0){
+		misc_deregister(misc);
+		kfree(misc->name);
+		return result;
 	}
-  
-	
-	spin_lock_init(curstate->hw_lock);
-	spin_lock_init(curstate->a_lock);
-	curstate->a_freq = 0;	/* portA timer is not running at start. */
-	
-	     
+	return 0;
+}
 
-	init_waitqueue_head(&curstate->c_waitqueue);
-	init_waitqueue_head(&curstate->b_waitqueue);
+/* takes the labjack out of both registries. After this no new opens
+ * can find it, but files already open keep their reference. */
+static void lj_unpublish(struct lj_state *state)
+{
+	struct miscdevice *devices[] = {
+		&state->achr_device, &state->bchr_device,
+		&state->cchr_device, &state->schr_device,
+		&state->statchr_device, &state->scanchr_device,
+		&state->diochr_device, &state->countchr_device,
+		&state->outchr_device,
+	};
+	int i;
 
-	usb_set_intfdata(intf, curstate);
-  
-	result = usb_bulk_msg(curstate->usb_device, 
-			usb_sndbulkpipe(curstate->usb_device, 1),
-			config_packet, CFGSIZE, &sent_len, 5);
-  
+	mutex_lock(&lj_idr_lock);
+	for(i = 0; i < ARRAY_SIZE(devices); i++){
+		if(idr_find(&lj_minor_idr, devices[i]->minor) == state)
+			idr_remove(&lj_minor_idr, devices[i]->minor);
+	}
+	if(idr_find(&lj_idr, state->devid) == state)
+		idr_remove(&lj_idr, state->devid);
+	mutex_unlock(&lj_idr_lock);
+}
 
-	if(result){
-		printk("Could not send bulk message to configure IO.\n");
-		goto err_hwlock;
+/* finds the labjack a char device belongs to, and takes a reference
+ * on it. Returns NULL if it is gone. */
+static struct lj_state* lj_state_get(int minor)
+{
+	struct lj_state *state;
+
+	rcu_read_lock();
+	state = idr_find(&lj_minor_idr, minor);
+	if(state && !kref_get_unless_zero(&state->kref))
+		state = NULL;
+	rcu_read_unlock();
+	return state;
+}
+
+static void fix_checksum16(u8* packet, u16 size)
+{
+	int i;
+	u16 acc = 0;
+	for (i = 6; i < size; i++){
+		acc += packet[i];
 	}
+	packet[4] = (u8)(acc & 0xff);
+	packet[5] = (u8)(acc >> 8);
+
+	fix_checksum8(packet, 6);
+
+}
+
+/* toggles fio_4 for the host timer. Called from the shared tick. */
+static void lj_a_toggle(struct lj_state *curstate)
+{
+	/* invert the state of fio4 */
+	curstate->fio4_state = curstate->fio4_state ? 0 : 1;
+
+	set_fio4_lvl(curstate, curstate->fio4_state);
+}
+
+/* makes sure the shared tick fires by ns, rounded up to LJ_TICK_NS so
+ * work due at about the same time shares a tick. Called with
+ * lj_tick_lock held. */
+static void lj_tick_arm(u64 ns)
+{
+	ns = DIV_ROUND_UP_ULL(ns, LJ_TICK_NS) * LJ_TICK_NS;
+	if(hrtimer_is_queued(&lj_tick_timer) && lj_tick_expires <= ns)
+		return;
+	lj_tick_expires = ns;
+	hrtimer_start(&lj_tick_timer, ns_to_ktime(ns), HRTIMER_MODE_ABS);
+}
+
+/* sets when one kind of periodic work is next due, 0 to stop it, and
+ * puts the labjack on the tick or takes it off. Returns -ENODEV once
+ * the labjack has gone. */
+static int lj_tick_set(struct lj_state *state, u64 *next, u64 ns)
+{
+	unsigned long flags;
+	int result = 0;
+
+	spin_lock_irqsave(&lj_tick_lock, flags);
+	if(ns && state->tick_dead){
+		result = -ENODEV;
+		goto out;
+	}
+	*next = ns;
+	if(ns){
+		if(list_empty(&state->tick_node))
+			list_add_tail(&state->tick_node, &lj_tick_list);
+		lj_tick_arm(ns);
+	}
+	else if(!state->c_next_ns && !state->b_next_ns && !state->a_next_ns)
+		list_del_init(&state->tick_node);
+out:
+	spin_unlock_irqrestore(&lj_tick_lock, flags);
+	return result;
+}
+
+/* takes the labjack off the tick for good. Once this returns, the tick
+ * won't touch it again. */
+static void lj_tick_remove(struct lj_state *state)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lj_tick_lock, flags);
+	state->tick_dead = 1;
+	state->c_next_ns = 0;
+	state->b_next_ns = 0;
+	state->a_next_ns = 0;
+	list_del_init(&state->tick_node);
+	spin_unlock_irqrestore(&lj_tick_lock, flags);
+}
+
+/* sends ConfigIO with the timer/counter and analog settings in the
+ * state's shadow copy. Must be called from process context, with
+ * cfg_mutex held unless the labjack is still being probed. */
+static int lj_config_io(struct lj_state *state)
+{
+	const int CFGSIZE = 12;
+	u8 config_packet[CFGSIZE];
+	u8 rcv_packet[CFGSIZE];
+	int result;
+
+	memset(config_packet, 0, CFGSIZE);
+	/* 8bit checksum */
+	config_packet[1] = 0xf8; 	/* ConfigIO packet */
+	config_packet[2] = 0x03;
+	config_packet[3] = 0x0b;
+	/* 16bit checksum */
+	config_packet[6] = 15;	/* set everything */
+	config_packet[7] = 0x00;	/* reserved */
+	config_packet[8] = state->cfg_timer;
+	config_packet[9] = 0x00;	/* deprecated */
+	config_packet[10] = state->cfg_fio_analog;
+	config_packet[11] = state->cfg_eio_analog;
+ 
+	fix_checksum16(config_packet, CFGSIZE);
+
+	result = lj_cmd_sync(state, config_packet, CFGSIZE,
+			rcv_packet, CFGSIZE);
+	if(result < 0){
+		printk("Could not configure IO: %d. Orig packet was:\n",
+			result);
+		print_arr(config_packet, CFGSIZE);
+		printk("\n");
+		return result;
+	}
+	if(rcv_packet[6])
+	{
+		printk("error in configio: %d\n", rcv_packet[6]);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* reads one 32 byte block of the U3's flash with ReadMem */
+static int lj_read_mem(struct lj_state *state, int block, u8 *data)
+{
+	const int MEMSIZE = 8;
+	const int MEMRCVSIZE = 40;
+	u8 mem_packet[MEMSIZE];
+	u8 rcv_packet[MEMRCVSIZE];
+	int result;
+
+	memset(mem_packet, 0, MEMSIZE);
+	mem_packet[1] = 0xf8;		/* ReadMem */
+	mem_packet[2] = 0x01;
+	mem_packet[3] = 0x2d;
+	mem_packet[7] = block;
+	fix_checksum16(mem_packet, MEMSIZE);
+
+	result = lj_cmd_sync(state, mem_packet, MEMSIZE,
+			rcv_packet, MEMRCVSIZE);
+	if(result < 0)
+		return result;
+	if(result < MEMRCVSIZE || rcv_packet[3] != 0x2d)
+		return -EIO;
+	if(rcv_packet[6]){
+		printk("error in readmem: %d\n", rcv_packet[6]);
+		return -EIO;
+	}
+	memcpy(data, rcv_packet + 8, 32);
+	return 0;
+}
+
+/* a constant is usable if it is within a tolerance of nominal */
+static int lj_cal_near(s64 value, s64 nominal, s64 tolerance)
+{
+	return value >= nominal - tolerance && value <= nominal + tolerance;
+}
+
+/* reads the calibration constants out of flash blocks 0 to 2. They
+ * are 32.32 fixed point, little endian. Anything missing or
+ * implausible leaves the nominal values in place. */
+static void lj_cal_read(struct lj_state *state)
+{
+	struct lj_cal *cal = &state->cal;
+	u8 data[3][32];
+	s64 c[3][4];
+	int result;
+	int i, j;
+
+	*cal = lj_cal_nominal;
+	for(i = 0; i < 3; i++){
+		result = lj_read_mem(state, i, data[i]);
+		if(result){
+			printk(KERN_INFO "Could not read calibration: %d, "
+				"using nominal values\n", result);
+			return;
+		}
+		for(j = 0; j < 4; j++)
+			c[i][j] = get_unaligned_le64(data[i] + 8*j);
+	}
+
+	/* block 0: single ended and differential AIN */
+	if(lj_cal_near(c[0][0], cal->se_slope, cal->se_slope / 8) &&
+		lj_cal_near(c[0][1], cal->se_offset, LJ_CAL_VOLT / 8) &&
+		lj_cal_near(c[0][2], cal->diff_slope, cal->diff_slope / 8) &&
+		lj_cal_near(c[0][3], cal->diff_offset, LJ_CAL_VOLT / 4)){
+		cal->se_slope = c[0][0];
+		cal->se_offset = c[0][1];
+		cal->diff_slope = c[0][2];
+		cal->diff_offset = c[0][3];
+	}
+	else
+		printk(KERN_INFO "bad AIN calibration, using nominal\n");
+
+	/* block 1: DAC0 and DAC1 */
+	if(lj_cal_near(c[1][0], cal->dac_slope[0], cal->dac_slope[0] / 8) &&
+		lj_cal_near(c[1][2], cal->dac_slope[1], cal->dac_slope[1] / 8)){
+		cal->dac_slope[0] = c[1][0];
+		cal->dac_offset[0] = c[1][1];
+		cal->dac_slope[1] = c[1][2];
+		cal->dac_offset[1] = c[1][3];
+	}
+	else
+		printk(KERN_INFO "bad DAC calibration, using nominal\n");
+
+	/* block 2: temperature sensor and Vref */
+	if(lj_cal_near(c[2][0], cal->temp_slope, cal->temp_slope / 8) &&
+		lj_cal_near(c[2][1], cal->vref, LJ_CAL_VOLT / 8)){
+		cal->temp_slope = c[2][0];
+		cal->vref = c[2][1];
+	}
+	else
+		printk(KERN_INFO "bad temperature calibration, using nominal\n");
+}
+
+/* turns a 32.32 slope and offset into a table entry that gives
+ * scale units per volt (or kelvin) */
+static struct lj_cal_entry lj_cal_make(s64 slope, s64 offset, int scale)
+{
+	struct lj_cal_entry entry = {
+		.slope = (slope * scale) >> (32 - LJ_CAL_SHIFT),
+		.offset = (offset * scale) >> (32 - LJ_CAL_SHIFT),
+	};
+	return entry;
+}
+
+/* builds the conversion tables from the calibration constants. AIN
+ * converts to uV, and the temperature sensor to mC. Every U3-LV
+ * channel shares the same constants, but the tables are per channel
+ * so they can tell apart the HV's high voltage inputs. */
+static void lj_cal_build(struct lj_state *state)
+{
+	struct lj_cal *cal = &state->cal;
+	struct lj_cal_entry *entry;
+	int i;
+
+	for(i = 0; i < LJ_CAL_CHANNELS; i++){
+		state->cal_ain[i][LJ_CAL_SE] = lj_cal_make(cal->se_slope,
+			cal->se_offset, USEC_PER_SEC);
+		state->cal_ain[i][LJ_CAL_DIFF] = lj_cal_make(cal->diff_slope,
+			cal->diff_offset, USEC_PER_SEC);
+		/* the special 0-3.6V range reads against Vref */
+		state->cal_ain[i][LJ_CAL_SPECIAL] =
+			lj_cal_make(cal->diff_slope,
+				cal->diff_offset + cal->vref, USEC_PER_SEC);
+	}
+
+	entry = &state->cal_temp;
+	*entry = lj_cal_make(cal->temp_slope, 0, 1000);
+	entry->offset = -273150LL << LJ_CAL_SHIFT;
+}
+
+/* finds the table entry for AIN pchannel read against nchannel */
+static const struct lj_cal_entry *lj_cal_lookup(struct lj_state *state,
+						int pchannel, int nchannel)
+{
+	int ch = pchannel & 0x1f;
+
+	if(ch == 30)
+		return &state->cal_temp;
+	if(ch >= LJ_CAL_CHANNELS)
+		ch = 0;
+	if(nchannel == 31)
+		return &state->cal_ain[ch][LJ_CAL_SE];
+	if(nchannel == 32)
+		return &state->cal_ain[ch][LJ_CAL_SPECIAL];
+	return &state->cal_ain[ch][LJ_CAL_DIFF];
+}
+
+/* converts a batch of raw readings, each with its own table entry. No
+ * divides and no branches, so it keeps up with any amount of data. */
+static void lj_cal_convert(const struct lj_cal_entry * const *entries,
+			const u16 *raw, s32 *out, int count)
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+		out[i] = (raw[i] * entries[i]->slope + entries[i]->offset) >>
+			LJ_CAL_SHIFT;
+}
+
+/* sets the clock the U3's timers count, 1MHz/divisor. A divisor of
+ * 256 is sent as 0. */
+static int lj_timer_clock(struct lj_state *state, int divisor)
+{
+	const int CLKSIZE = 10;
+	u8 clk_packet[CLKSIZE];
+	u8 rcv_packet[CLKSIZE];
+	int result;
+
+	memset(clk_packet, 0, CLKSIZE);
+	clk_packet[1] = 0xf8;		/* ConfigTimerClock */
+	clk_packet[2] = 0x02;
+	clk_packet[3] = 0x0a;
+	clk_packet[8] = 0x80 | 3;	/* write, 1MHz/divisor */
+	clk_packet[9] = divisor & 0xff;
+	fix_checksum16(clk_packet, CLKSIZE);
+
+	result = lj_cmd_sync(state, clk_packet, CLKSIZE, rcv_packet, CLKSIZE);
+	if(result < 0)
+		return result;
+	if(rcv_packet[6]){
+		printk("error in configtimerclock: %d\n", rcv_packet[6]);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* picks a Timer0 mode for a square wave of period us. Short periods
+ * use frequency output, which toggles every value ticks. Longer ones
+ * use 16 bit PWM at 50% duty. Returns the period actually produced,
+ * or 0 if it is too long for the hardware. */
+static u32 lj_a_hw_setting(u32 us, int *mode, int *divisor, int *value)
+{
+	u32 ticks;
+	u32 err;
+	u32 best_err = ~0;
+	int div;
+	int val;
+
+	if(us <= 2*256*256){
+		/* frequency output, period = 2*divisor*value ticks */
+		ticks = max(us / 2, 1U);
+		for(div = 1; div <= 256; div++){
+			val = DIV_ROUND_CLOSEST(ticks, div);
+			if(val < 1 || val > 256)
+				continue;
+			err = abs((int)(div*val) - (int)ticks);
+			if(err < best_err){
+				best_err = err;
+				*divisor = div;
+				*value = val;
+			}
+		}
+		*mode = 7;
+		return 2 * *divisor * *value;
+	}
+
+	if(us > LJ_PORTA_HW_MAX)
+		return 0;
+
+	/* PWM, period = 65536*divisor ticks */
+	*mode = 0;
+	*divisor = clamp_t(int, DIV_ROUND_CLOSEST(us, 65536), 1, 256);
+	*value = 32768;
+	return 65536 * *divisor;
+}
+
+/* sets req up as a TimerConfig for timer 0 or 1 */
+static void lj_timer_req(struct lj_req *req, int timer, int mode, int value)
+{
+	req->cmd[0] = 43 + 2*timer;	/* Timer0Config or Timer1Config */
+	req->cmd[1] = mode;
+	req->cmd[2] = value & 0xff;	/* 256 is sent as 0 */
+	req->cmd[3] = (value >> 8) & 0xff;
+	req->cmd_len = 4;
+	req->resp_len = 0;
+}
+
+/* FIO lines the timers and counters have taken. They get pins in
+ * order from the pin offset: Timer0, Timer1, then Counter1. Called
+ * with cfg_mutex held. */
+static u32 lj_timer_pins(struct lj_state *state)
+{
+	int count = state->tmr_a + !!state->tmr_in_mode + state->tmr_counter;
+
+	return ((1 << count) - 1) << (state->tmr_a ? 4 : 5);
+}
+
+/* sends the timer clock, ConfigIO and TimerConfigs for what portA and
+ * the counter port want. portA's Timer0 is always on FIO4. When portA
+ * isn't using it, the pin offset moves to FIO5, so the counter port's
+ * pins stay put. Its input timer is then Timer0, and otherwise Timer1.
+ * Called with cfg_mutex held. */
+static int lj_timers_apply(struct lj_state *state)
+{
+	struct lj_req *reqs = state->tmr_reqs;
+	int ntimers = state->tmr_a + !!state->tmr_in_mode;
+	int count = 0;
+	int result;
+
+	if(ntimers){
+		result = lj_timer_clock(state,
+				state->tmr_a ? state->tmr_a_div : 1);
+		if(result)
+			return result;
+	}
+
+	state->cfg_timer = ((state->tmr_a ? 4 : 5) << 4) | ntimers |
+		(state->tmr_counter ? 0x08 : 0);
+	result = lj_config_io(state);
+	if(result)
+		return result;
+
+	if(state->tmr_a)
+		lj_timer_req(&reqs[count++], 0, state->tmr_a_mode,
+			state->tmr_a_value);
+	if(state->tmr_in_mode)
+		lj_timer_req(&reqs[count++], state->tmr_a,
+			state->tmr_in_mode, 0);
+	if(!count)
+		return 0;
+	return lj_req_sync_batch(state, reqs, count, LJ_PRIO_OUTPUT);
+}
+
+/* drives FIO4 from Timer0 instead of toggling it from a_poll_timer.
+ * Called with a_mutex held. */
+static int lj_a_hw_start(struct lj_state *state, u32 us)
+{
+	int mode, divisor, value;
+	u32 period;
+	int result;
+
+	period = lj_a_hw_setting(us, &mode, &divisor, &value);
+	if(!period)
+		return -ERANGE;
+
+	mutex_lock(&state->cfg_mutex);
+	state->tmr_a = 1;
+	state->tmr_a_mode = mode;
+	state->tmr_a_value = value;
+	state->tmr_a_div = divisor;
+	result = lj_timers_apply(state);
+	if(result){
+		state->tmr_a = 0;
+		lj_timers_apply(state);
+	}
+	mutex_unlock(&state->cfg_mutex);
+	if(result)
+		return result;
+
+	state->a_hw = 1;
+	state->a_period_us = period;
+	state->a_hw_start = ktime_get_ns();
+	printk(KERN_INFO "portA: Timer0 mode %d, period %uus\n", mode, period);
+	return 0;
+}
+
+/* gives FIO4 back to the digital IO. Called with a_mutex held. */
+static int lj_a_hw_stop(struct lj_state *state)
+{
+	int result;
+
+	if(!state->a_hw)
+		return 0;
+	state->a_hw = 0;
+	state->a_period_us = 0;
+	mutex_lock(&state->cfg_mutex);
+	state->tmr_a = 0;
+	result = lj_timers_apply(state);
+	mutex_unlock(&state->cfg_mutex);
+	return result;
+}
+
+/* stops the host toggle timer */
+static void lj_a_sw_stop(struct lj_state *state)
+{
+	lj_tick_set(state, &state->a_next_ns, 0);
+	state->a_freq = 0;
+	if(!state->a_hw)
+		state->a_period_us = 0;
+}
+
+/* makes FIO4 a square wave with a period of us, in hardware when it
+ * fits in Timer0 and from the shared tick otherwise. 0 stops it. Called
+ * with a_mutex held. */
+static int lj_a_set_period(struct lj_state *state, u32 us)
+{
+	int result;
+
+	lj_a_sw_stop(state);
+	if(us && state->req_dead)
+		return -ENODEV;
+
+	if(us && us <= LJ_PORTA_HW_MAX){
+		result = lj_a_hw_start(state, us);
+		goto out;
+	}
+
+	result = lj_a_hw_stop(state);
+	if(result || !us)
+		goto out;
+
+	/* a_freq is the time between toggles, in seconds */
+	state->a_freq = clamp_t(u32, us / 2 / USEC_PER_SEC, 1, 255);
+	state->a_period_us = 2 * state->a_freq * USEC_PER_SEC;
+	result = lj_tick_set(state, &state->a_next_ns,
+			ktime_get_ns() + (u64)state->a_freq * NSEC_PER_SEC);
+	if(result){
+		state->a_freq = 0;
+		state->a_period_us = 0;
+	}
+out:
+	lj_status_porta(state);
+	return result;
+}
+
+
+/* the default airlock rule: EIN2 on AIN10 crossing 1V, which is a raw
+ * reading of about 26860. The band keeps noise near 1V from flapping
+ * the airlock. */
+static const struct lj_rule lj_airlock_rule = {
+	.index = 0,
+	.channel = 10,
+	.flags = LJ_RULE_ENABLED | LJ_RULE_AIRLOCK,
+	.debounce = 1,
+	.high = 27200,
+	.low = 26500,
+};
+
+static void lj_rule_event(struct lj_state *state, int rule, int type,
+			u16 value, u64 now)
+{
+	struct lj_event event = {
+		.timestamp_ns = now,
+		.rule = rule,
+		.type = type,
+		.value = value,
+	};
+
+	if(!kfifo_put(&state->events, event))
+		state->events_lost++;
+}
+
+/* checks a new sample against its rule. Called with rules_lock held.
+ * Returns nonzero if portC readers need waking. */
+static int lj_rule_eval(struct lj_state *state, struct lj_rule_state *rs,
+			u16 raw)
+{
+	struct lj_rule *rule = &rs->cfg;
+	u64 now = ktime_get_ns();
+	int level = rs->level;
+	int wake = 0;
+
+	if(rule->max_delta && rs->have_last &&
+		abs((int)raw - (int)rs->last) > rule->max_delta){
+		lj_rule_event(state, rule->index, LJ_EVENT_RATE, raw, now);
+		wake = 1;
+	}
+	rs->last = raw;
+	rs->have_last = 1;
+
+	if(raw >= rule->high)
+		level = 1;
+	else if(raw <= rule->low)
+		level = 0;
+	else if(rs->level < 0)	/* first sample, inside the band */
+		level = raw > (rule->high + rule->low) / 2;
+
+	if(level == rs->level){
+		rs->count = 0;
+		return wake;
+	}
+	if(rs->level >= 0 && ++rs->count < rule->debounce)
+		return wake;
+
+	rs->count = 0;
+	rs->level = level;
+
+	if(level && (rule->flags & LJ_RULE_RISING)){
+		lj_rule_event(state, rule->index, LJ_EVENT_HIGH, raw, now);
+		wake = 1;
+	}
+	if(!level && (rule->flags & LJ_RULE_FALLING)){
+		lj_rule_event(state, rule->index, LJ_EVENT_LOW, raw, now);
+		wake = 1;
+	}
+	if((rule->flags & LJ_RULE_AIRLOCK) && state->airlock != air_error){
+		printk(KERN_INFO "airlock %s on AIN%d\n",
+			level ? "opened" : "closed", rule->channel);
+		state->airlock = level ? air_open : air_closed;
+		lj_status_airlock(state);
+		wake |= level;
+	}
+	return wake;
+}
+
+/* nonzero if a rule is close to changing, so portC should sample it
+ * quickly: it hasn't settled, it is inside or within a band's width of
+ * the threshold it would cross next, or it is moving fast enough to
+ * reach it within LJ_PORTC_LOOKAHEAD samples. Called with rules_lock
+ * held, before lj_rule_eval. */
+static int lj_rule_hot(struct lj_rule_state *rs, u16 raw)
+{
+	struct lj_rule *rule = &rs->cfg;
+	int delta = rs->have_last ? abs((int)raw - (int)rs->last) : 0;
+	int band = rule->high - rule->low;
+	int distance;
+
+	if(rs->level < 0 || rs->count)
+		return 1;
+	if(rule->max_delta && 2 * delta > rule->max_delta)
+		return 1;
+	distance = rs->level ? (int)raw - rule->low : (int)rule->high - raw;
+	return distance <= band + LJ_PORTC_LOOKAHEAD * delta;
+}
+
+/* the period portC polls with while a rule is about to change */
+static u32 lj_c_fast(struct lj_state *state)
+{
+	return max_t(u32, state->c_period_us / LJ_PORTC_SPEEDUP,
+		LJ_PORTC_MIN_PERIOD);
+}
+
+static void c_req_done(struct lj_req *req)
+{
+	struct lj_rule_state *rs = req->context;
+	struct lj_state *curstate = rs->state;
+	unsigned long flags;
+	u16 raw;
+	int wake = 0;
+
+	if(req->result){
+		printk(KERN_INFO "Error in portC poll: %d.\n", req->result);
+		return;
+	}
+
+	raw = req->resp[0] + (req->resp[1] << 8);
+	spin_lock_irqsave(&curstate->rules_lock, flags);
+	if(rs->cfg.flags & LJ_RULE_ENABLED){
+		if(lj_rule_hot(rs, raw))
+			curstate->c_hot = 1;
+		wake = lj_rule_eval(curstate, rs, raw);
+	}
+	spin_unlock_irqrestore(&curstate->rules_lock, flags);
+
+	if(wake)
+		wake_up_interruptible(&curstate->c_waitqueue);
+}
+
+/* samples the channel of every enabled rule. The requests are all
+ * queued before the pipe is kicked, so they go out together in as few
+ * Feedback packets as they fit. Returns the period to poll again in,
+ * in us. Called from the shared tick. */
+static u32 lj_c_poll(struct lj_state *curstate)
+{
+	struct lj_rule_state *rs;
+	struct lj_req *req;
+	unsigned long flags;
+	u32 us;
+	int result;
+	int i;
+
+	for(i = 0; i < LJ_MAX_RULES; i++){
+		rs = &curstate->rules[i];
+		req = &rs->req;
+
+		spin_lock_irqsave(&curstate->rules_lock, flags);
+		if(!(rs->cfg.flags & LJ_RULE_ENABLED) ||
+			(req->flags & LJ_REQ_PENDING)){
+			spin_unlock_irqrestore(&curstate->rules_lock, flags);
+			continue;
+		}
+		req->flags = 0;
+		req->prio = LJ_PRIO_POLL;
+		req->cmd[0] = 0x01;		/* Do an analog in */
+		req->cmd[1] = rs->cfg.channel;
+		req->cmd[2] = 31;		/* compare it to gnd */
+		req->cmd_len = 3;
+		req->resp_len = 2;
+		req->done = c_req_done;
+		req->context = rs;
+		spin_unlock_irqrestore(&curstate->rules_lock, flags);
+
+		/* if the last poll hasn't come back yet, skip this one */
+		result = lj_req_queue(curstate, req);
+		if(result && result != -EBUSY)
+			printk(KERN_INFO "Could not poll portC: %d\n", result);
+	}
+	lj_req_kick(curstate);
+
+	/* speed up if any rule was about to change, otherwise back off
+	 * towards c_period_us */
+	spin_lock_irqsave(&curstate->rules_lock, flags);
+	if(curstate->c_hot)
+		us = lj_c_fast(curstate);
+	else
+		us = min(2 * curstate->c_cur_us, curstate->c_period_us);
+	curstate->c_hot = 0;
+	curstate->c_cur_us = us;
+	spin_unlock_irqrestore(&curstate->rules_lock, flags);
+	return us;
+}
+
+/* sets up the rules portC starts with: just the airlock rule */
+static void lj_rules_init(struct lj_state *state)
+{
+	int i;
+
+	spin_lock_init(&state->rules_lock);
+	INIT_KFIFO(state->events);
+	for(i = 0; i < LJ_MAX_RULES; i++){
+		state->rules[i].state = state;
+		state->rules[i].cfg.index = i;
+		state->rules[i].level = -1;
+	}
+	state->rules[0].cfg = lj_airlock_rule;
+	mutex_init(&state->c_mutex);
+	state->c_period_us = LJ_PORTC_PERIOD;
+	/* nothing is known until portC has polled */
+	state->airlock = air_closed;
+}
+
+/* starts polling for the rules, if nobody has yet. The rules forget
+ * what they saw when polling last ran, since that may be long gone,
+ * so the airlock stays closed until the first poll is back. */
+static int lj_c_demand(struct lj_state *state)
+{
+	unsigned long flags;
+	int result = 0;
+	int i;
+
+	mutex_lock(&state->c_mutex);
+	if(state->c_active)
+		goto out;
+
+	spin_lock_irqsave(&state->rules_lock, flags);
+	for(i = 0; i < LJ_MAX_RULES; i++){
+		state->rules[i].level = -1;
+		state->rules[i].count = 0;
+		state->rules[i].have_last = 0;
+	}
+	state->c_hot = 0;
+	state->c_cur_us = lj_c_fast(state);
+	spin_unlock_irqrestore(&state->rules_lock, flags);
+
+	/* req_lock keeps this from racing with disconnect */
+	spin_lock_irqsave(&state->req_lock, flags);
+	if(state->req_dead){
+		spin_unlock_irqrestore(&state->req_lock, flags);
+		result = -ENODEV;
+		goto out;
+	}
+	if(state->airlock == air_open){
+		state->airlock = air_closed;
+		lj_status_airlock(state);
+	}
+	spin_unlock_irqrestore(&state->req_lock, flags);
+
+	result = lj_tick_set(state, &state->c_next_ns, ktime_get_ns());
+	if(!result)
+		state->c_active = 1;
+out:
+	mutex_unlock(&state->c_mutex);
+	return result;
+}
+
+/* sets req up as a read of AIN pchannel against nchannel, 31 being
+ * gnd. Bit 6 of pchannel asks for long settling and bit 7 for a quick
+ * sample. */
+static void lj_ain_req(struct lj_req *req, int pchannel, int nchannel)
+{
+	req->cmd[0] = 0x01;		/* Do an analog in */
+	req->cmd[1] = pchannel;
+	req->cmd[2] = nchannel;
+	req->cmd_len = 3;
+	req->resp_len = 2;
+}
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+
+#define LJ_IIO_AIN(n) {						\
+	.type = IIO_VOLTAGE,					\
+	.indexed = 1,						\
+	.channel = n,						\
+	.address = n,						\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW),		\
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE) |	\
+		BIT(IIO_CHAN_INFO_OFFSET),			\
+	.scan_index = n,					\
+	.scan_type = {						\
+		.sign = 'u',					\
+		.realbits = 16,					\
+		.storagebits = 16,				\
+		.endianness = IIO_CPU,				\
+	},							\
+}
+
+static const struct iio_chan_spec lj_iio_channels[] = {
+	LJ_IIO_AIN(0), LJ_IIO_AIN(1), LJ_IIO_AIN(2), LJ_IIO_AIN(3),
+	LJ_IIO_AIN(4), LJ_IIO_AIN(5), LJ_IIO_AIN(6), LJ_IIO_AIN(7),
+	LJ_IIO_AIN(8), LJ_IIO_AIN(9), LJ_IIO_AIN(10), LJ_IIO_AIN(11),
+	LJ_IIO_AIN(12), LJ_IIO_AIN(13), LJ_IIO_AIN(14), LJ_IIO_AIN(15),
+	{
+		.type = IIO_TEMP,
+		.address = 30,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |
+			BIT(IIO_CHAN_INFO_SCALE) | BIT(IIO_CHAN_INFO_OFFSET),
+		.scan_index = LJ_IIO_NUM_AIN,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 16,
+			.storagebits = 16,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(LJ_IIO_NUM_AIN + 1),
+};
+
+/* FIO and EIO lines read garbage unless ConfigIO made them analog */
+static int lj_ain_is_analog(struct lj_state *state, int channel)
+{
+	if(channel < 8)
+		return (state->cfg_fio_analog >> channel) & 1;
+	return (state->cfg_eio_analog >> (channel - 8)) & 1;
+}
+
+/* num / slope, as IIO's integer and micro parts. Both parts carry the
+ * sign. */
+static void lj_iio_offset(s64 num, s64 slope, int *val, int *val2)
+{
+	s32 rem;
+
+	*val = div_s64_rem(num, slope, &rem);
+	*val2 = div_s64((s64)rem * 1000000, slope);
+}
+
+static int lj_iio_read_raw(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan,
+			int *val, int *val2, long mask)
+{
+	struct lj_iio *priv = iio_priv(indio_dev);
+	struct lj_state *state = priv->state;
+	struct lj_req req;
+	int result;
+
+	switch(mask){
+	case IIO_CHAN_INFO_RAW:
+		if(chan->type == IIO_VOLTAGE &&
+			!lj_ain_is_analog(state, chan->channel))
+			return -EBUSY;
+		result = iio_device_claim_direct_mode(indio_dev);
+		if(result)
+			return result;
+		req.flags = 0;
+		lj_ain_req(&req, chan->address, 31);
+		result = lj_req_sync(state, &req, LJ_PRIO_BULK);
+		iio_device_release_direct_mode(indio_dev);
+		if(result)
+			return result;
+		*val = req.resp[0] + (req.resp[1] << 8);
+		return IIO_VAL_INT;
+
+	/* from the U3's own calibration, which is 32.32 fixed point in
+	 * volts or kelvin, so (raw + offset) * scale is in mV or mC */
+	case IIO_CHAN_INFO_SCALE:
+		if(chan->type == IIO_TEMP){
+			*val = (state->cal.temp_slope * 1000) >> 8;
+			*val2 = 24;
+		}
+		else{
+			*val = state->cal.se_slope * 1000;
+			*val2 = 32;
+		}
+		return IIO_VAL_FRACTIONAL_LOG2;
+
+	case IIO_CHAN_INFO_OFFSET:
+		if(chan->type == IIO_TEMP)
+			/* 0C in bits */
+			lj_iio_offset(-div_s64(27315LL << 32, 100),
+				state->cal.temp_slope, val, val2);
+		else
+			lj_iio_offset(state->cal.se_offset,
+				state->cal.se_slope, val, val2);
+		return IIO_VAL_INT_PLUS_MICRO;
+	}
+	return -EINVAL;
+}
+
+/* a scan can only hold AIN lines that are analog */
+static int lj_iio_check_scan(struct lj_state *state,
+			const unsigned long *scan_mask)
+{
+	int bit;
+
+	for_each_set_bit(bit, scan_mask, LJ_IIO_NUM_AIN){
+		if(!lj_ain_is_analog(state, lj_iio_channels[bit].channel))
+			return -EBUSY;
+	}
+	return 0;
+}
+
+static int lj_iio_update_scan_mode(struct iio_dev *indio_dev,
+				const unsigned long *scan_mask)
+{
+	struct lj_iio *priv = iio_priv(indio_dev);
+
+	return lj_iio_check_scan(priv->state, scan_mask);
+}
+
+/* reads every channel in the scan in one go. The AIN requests get
+ * packed into as few Feedback packets as they fit in. Runs in the
+ * pollfunc's thread, so it can sleep. */
+static irqreturn_t lj_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct lj_iio *priv = iio_priv(indio_dev);
+	int count = 0;
+	int bit;
+	int i;
+
+	/* ConfigIO may have taken a line back since the scan started */
+	if(lj_iio_check_scan(priv->state, indio_dev->active_scan_mask))
+		goto out;
+
+	for_each_set_bit(bit, indio_dev->active_scan_mask,
+			indio_dev->masklength){
+		if(bit > LJ_IIO_NUM_AIN)
+			continue;	/* the timestamp */
+		lj_ain_req(&priv->reqs[count++],
+			lj_iio_channels[bit].address, 31);
+	}
+
+	if(!lj_req_sync_batch(priv->state, priv->reqs, count,
+			LJ_PRIO_POLL)){
+		for(i = 0; i < count; i++)
+			priv->scan[i] = priv->reqs[i].resp[0] +
+				(priv->reqs[i].resp[1] << 8);
+		iio_push_to_buffers_with_timestamp(indio_dev, priv->scan,
+						pf->timestamp);
+	}
+
+out:
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+static const struct iio_info lj_iio_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = lj_iio_read_raw,
+	.update_scan_mode = lj_iio_update_scan_mode,
+};
+
+/* registers the labjack's IIO device. Any trigger works with it,
+ * including the hrtimer and sysfs software triggers. */
+static int lj_iio_register(struct lj_state *state, struct usb_interface *intf)
+{
+	struct iio_dev *indio_dev;
+	struct lj_iio *priv;
+	int result;
+
+	indio_dev = iio_device_alloc(sizeof(*priv));
+	if(!indio_dev)
+		return -ENOMEM;
+
+	priv = iio_priv(indio_dev);
+	priv->state = state;
+	indio_dev->dev.parent = &intf->dev;
+	indio_dev->name = "labjack-u3";
+	indio_dev->info = &lj_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = lj_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(lj_iio_channels);
+
+	result = iio_triggered_buffer_setup(indio_dev, iio_pollfunc_store_time,
+					lj_iio_trigger_handler, NULL);
+	if(result)
+		goto err_free;
+
+	result = iio_device_register(indio_dev);
+	if(result)
+		goto err_buffer;
+
+	state->iio_dev = indio_dev;
+	return 0;
+
+err_buffer:
+	iio_triggered_buffer_cleanup(indio_dev);
+err_free:
+	iio_device_free(indio_dev);
+	return result;
+}
+
+static void lj_iio_unregister(struct lj_state *state)
+{
+	if(!state->iio_dev)
+		return;
+	iio_device_unregister(state->iio_dev);
+	iio_triggered_buffer_cleanup(state->iio_dev);
+	iio_device_free(state->iio_dev);
+	state->iio_dev = NULL;
+}
+
+#else
+
+static int lj_iio_register(struct lj_state *state, struct usb_interface *intf)
+{
+	return 0;
+}
+
+static void lj_iio_unregister(struct lj_state *state)
+{
+}
+
+#endif
+
+static const char *lj_kind_names[LJ_NUM_KINDS] = {
+	[LJ_KIND_AIN] = "ain",
+	[LJ_KIND_TEMP] = "temp",
+	[LJ_KIND_BIT_WRITE] = "bitwrite",
+	[LJ_KIND_FEEDBACK] = "feedback",
+	[LJ_KIND_CONFIG_IO] = "configio",
+	[LJ_KIND_RAW] = "raw",
+};
+
+/* debugfs latency: a log2 histogram of request latency for each kind
+ * of request, in us */
+static int lj_latency_show(struct seq_file *m, void *v)
+{
+	struct lj_state *state = m->private;
+	struct lj_stats *stats;
+	u64 hist[LJ_HIST_BUCKETS];
+	u64 total;
+	u64 errors;
+	int kind, cpu, i;
+
+	for(kind = 0; kind < LJ_NUM_KINDS; kind++){
+		memset(hist, 0, sizeof(hist));
+		errors = 0;
+		for_each_possible_cpu(cpu){
+			stats = per_cpu_ptr(state->stats, cpu);
+			for(i = 0; i < LJ_HIST_BUCKETS; i++)
+				hist[i] += stats->latency[kind][i];
+			errors += stats->errors[kind];
+		}
+
+		total = 0;
+		for(i = 0; i < LJ_HIST_BUCKETS; i++)
+			total += hist[i];
+		if(!total)
+			continue;
+
+		seq_printf(m, "%s: %llu requests, %llu errors\n",
+			lj_kind_names[kind], total, errors);
+		for(i = 0; i < LJ_HIST_BUCKETS; i++){
+			if(!hist[i])
+				continue;
+			if(i == LJ_HIST_BUCKETS - 1)
+				seq_printf(m, "  >= %7luus: %llu\n",
+					1UL << (i - 1), hist[i]);
+			else
+				seq_printf(m, "  <  %7luus: %llu\n",
+					1UL << i, hist[i]);
+		}
+	}
+	return 0;
+}
+
+/* debugfs traffic: bytes moved, and bad checksum responses */
+static int lj_traffic_show(struct seq_file *m, void *v)
+{
+	struct lj_state *state = m->private;
+	struct lj_stats *stats;
+	u64 out = 0, in = 0, checksum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu){
+		stats = per_cpu_ptr(state->stats, cpu);
+		out += stats->bytes_out;
+		in += stats->bytes_in;
+		checksum += stats->checksum_errors;
+	}
+	seq_printf(m, "bytes_out: %llu\nbytes_in: %llu\n"
+		"checksum_errors: %llu\n", out, in, checksum);
+	return 0;
+}
+
+/* debugfs sched: each class's limit, queue and waits */
+static int lj_sched_show(struct seq_file *m, void *v)
+{
+	static const char * const names[LJ_NUM_PRIO] = {
+		"output", "poll", "bulk"
+	};
+	struct lj_state *state = m->private;
+	struct lj_sched copy;
+	unsigned long flags;
+	int prio;
+
+	for(prio = 0; prio < LJ_NUM_PRIO; prio++){
+		spin_lock_irqsave(&state->req_lock, flags);
+		copy = state->sched[prio];
+		spin_unlock_irqrestore(&state->req_lock, flags);
+
+		seq_printf(m, "%s: rate %u/s burst %u, depth %u (max %u), "
+			"sent %llu, throttled %llu, wait avg %lluus max "
+			"%lluus\n", names[prio], copy.rate, copy.burst,
+			copy.depth, copy.max_depth, copy.sent, copy.throttled,
+			div64_u64(copy.wait_ns_total,
+				(copy.sent ?: 1) * NSEC_PER_USEC),
+			div_u64(copy.wait_ns_max, NSEC_PER_USEC));
+	}
+	return 0;
+}
+
+static int lj_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lj_latency_show, inode->i_private);
+}
+
+static int lj_traffic_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lj_traffic_show, inode->i_private);
+}
+
+static const struct file_operations lj_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = lj_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lj_sched_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lj_sched_show, inode->i_private);
+}
+
+static const struct file_operations lj_sched_fops = {
+	.owner = THIS_MODULE,
+	.open = lj_sched_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations lj_traffic_fops = {
+	.owner = THIS_MODULE,
+	.open = lj_traffic_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static  int lj_probe(struct usb_interface *intf, const struct usb_device_id *id)
+{
+  
+	struct usb_device *usb_device;
+  
+	struct lj_state *curstate = NULL;
+
+	int result;
+	const int DIGSIZE = 10;
+	const int DIGRCVSIZE = 10;
+	u8 dig_packet[DIGSIZE];
+	u8 digrcv_packet[DIGRCVSIZE];
+	int devid;
+	int i;
+	char *tmpname = NULL;
+	char dbgname[LJ_NAMESIZE];
+	/* configure the packet to set FIO4 as output */
+
+	/* 8bit checksum */
+	dig_packet[1] = 0xf8;
+	dig_packet[2] = 0x2; 		/* number of words is .5 + 1.5 */
+	dig_packet[3] = 0x00;
+	/* 16bit checksum */
+	dig_packet[6] = 0x00;		/* echo can be whatever we want */
+	dig_packet[7] = 13;		/* Do a digital dir set */
+	dig_packet[8] = 0x84;		/* set FIO4 as output */
+	dig_packet[9] = 00;		/* padding*/
+
+	fix_checksum16(dig_packet, DIGSIZE);
+
+
+	printk(KERN_INFO "You were probed!!!\n");
+
+	curstate = kzalloc(sizeof(struct lj_state), GFP_KERNEL);
+  
+	if(!curstate){
+		printk( KERN_INFO 
+			"Could not allocate memory for labjack state!!!\n");
+		goto error;
+	}
+  
+	kref_init(&curstate->kref);
+	curstate->stats = alloc_percpu(struct lj_stats);
+	if(!curstate->stats){
+		printk(KERN_INFO "Could not allocate statistics!\n");
+		goto err_free;
+	}
+	curstate->status = (struct lj_status_page *)
+		get_zeroed_page(GFP_KERNEL);
+	if(!curstate->status){
+		printk(KERN_INFO "Could not allocate status page!\n");
+		goto err_free;
+	}
+	curstate->status->version = LJ_STATUS_VERSION;
+	curstate->out_ring = kcalloc(LJ_OUT_RING, sizeof(struct lj_out_ent),
+				GFP_KERNEL);
+	if(!curstate->out_ring){
+		printk(KERN_INFO "Could not allocate out ring!\n");
+		goto err_free;
+	}
+	spin_lock_init(&curstate->status_lock);
+	mutex_init(&curstate->cfg_mutex);
+	mutex_init(&curstate->scan_mutex);
+	mutex_init(&curstate->dio_mutex);
+	mutex_init(&curstate->out_mutex);
+	spin_lock_init(&curstate->out_lock);
+	init_waitqueue_head(&curstate->out_waitqueue);
+	usb_device = interface_to_usbdev(intf);
+  
+	curstate->usb_device = usb_get_dev(usb_device);
+
+
+	INIT_LIST_HEAD(&curstate->tick_node);
+	curstate->a_freq = 0;	/* portA timer is not running at start. */
+	mutex_init(&curstate->a_mutex);
+	
+	     
+
+	init_waitqueue_head(&curstate->c_waitqueue);
+	init_waitqueue_head(&curstate->b_waitqueue);
+	lj_rules_init(curstate);
+	init_waitqueue_head(&curstate->s_waitqueue);
+	for(i = 0; i < LJ_NUM_PRIO; i++)
+		INIT_LIST_HEAD(&curstate->sched[i].queue);
+	lj_sched_limit(&curstate->sched[LJ_PRIO_OUTPUT], LJ_OUTPUT_RATE,
+		LJ_OUTPUT_BURST);
+	lj_sched_limit(&curstate->sched[LJ_PRIO_POLL], LJ_POLL_RATE,
+		LJ_POLL_BURST);
+	lj_sched_limit(&curstate->sched[LJ_PRIO_BULK], 0, 1);
+	INIT_LIST_HEAD(&curstate->req_inflight);
+	spin_lock_init(&curstate->req_lock);
+	setup_timer(&curstate->req_timer, lj_req_timeout,
+		(unsigned long)curstate);
+	mutex_init(&curstate->stream_mutex);
+	spin_lock_init(&curstate->stream_lock);
+	seqlock_init(&curstate->temp_lock);
+	spin_lock_init(&curstate->b_lock);
+	mutex_init(&curstate->b_sample_mutex);
+
+	usb_set_intfdata(intf, curstate);
+
+	result = lj_pool_alloc(curstate);
+	if(result){
+		printk(KERN_INFO "Could not allocate transfer pool!\n");
+		goto err_free;
+	}
+
+	curstate->cfg_timer = 0x40;	/* offset must be at least 4*/
+	curstate->cfg_fio_analog = 0x00;	/* no Analog on FIO */
+	curstate->cfg_eio_analog = 0x04;	/* EIO2 is AIN10 */
+	if(lj_config_io(curstate))
+		goto err_pool;
+
+	lj_cal_read(curstate);
+	lj_cal_build(curstate);
+
+
+	/* now set FIO4 as a digital output */
+	result = lj_cmd_sync(curstate, dig_packet, DIGSIZE,
+			digrcv_packet, DIGRCVSIZE);
+	if(result < 0){
+		printk("Could not configure FIO4: %d. Orig packet was:\n",
+			result);
+		print_arr(dig_packet, DIGSIZE);
+		printk("\n");
+		goto err_pool;
+	}
+	if(digrcv_packet[6])
+	{
+		printk("error in configio: %d\n", digrcv_packet[6]);
+		goto err_pool;
+	}
+  
+	mutex_lock(&lj_idr_lock);
+	devid = idr_alloc(&lj_idr, curstate, 0, 0, GFP_KERNEL);
+	mutex_unlock(&lj_idr_lock);
+	if(devid < 0){
+		printk(KERN_INFO
+			"could not add usb_interface to interface table!\n");
+		goto err_pool;
+	}
+	curstate->devid = devid;
+
+	/* debugfs is best effort, nothing fails if it isn't there */
+	snprintf(dbgname, LJ_NAMESIZE, "lab%d", devid);
+	curstate->debugfs_dir = debugfs_create_dir(dbgname, lj_debugfs_root);
+	debugfs_create_u32("pool_exhausted", S_IRUGO, curstate->debugfs_dir,
+			&curstate->pool_exhausted);
+	debugfs_create_u32("pool_in_use", S_IRUGO, curstate->debugfs_dir,
+			&curstate->pool_in_use);
+	debugfs_create_u32("pool_max_in_use", S_IRUGO, curstate->debugfs_dir,
+			&curstate->pool_max_in_use);
+	debugfs_create_u32("feedback_packets", S_IRUGO, curstate->debugfs_dir,
+			&curstate->fb_packets);
+	debugfs_create_u32("feedback_reqs", S_IRUGO, curstate->debugfs_dir,
+			&curstate->fb_reqs);
+	debugfs_create_u32("max_inflight", S_IRUGO, curstate->debugfs_dir,
+			&curstate->req_max_inflight);
+	debugfs_create_u32("stray_responses", S_IRUGO, curstate->debugfs_dir,
+			&curstate->req_stray);
+	debugfs_create_u32("timeouts", S_IRUGO, curstate->debugfs_dir,
+			&curstate->req_timeouts);
+	debugfs_create_u32("events_lost", S_IRUGO, curstate->debugfs_dir,
+			&curstate->events_lost);
+	
+	debugfs_create_u32("portc_missed", S_IRUGO, curstate->debugfs_dir,
+			&curstate->c_missed);
+	debugfs_create_u32("portc_period_us", S_IRUGO, curstate->debugfs_dir,
+			&curstate->c_cur_us);
+	debugfs_create_file("latency", S_IRUGO, curstate->debugfs_dir,
+			curstate, &lj_latency_fops);
+	debugfs_create_file("traffic", S_IRUGO, curstate->debugfs_dir,
+			curstate, &lj_traffic_fops);
+	debugfs_create_file("sched", S_IRUGO, curstate->debugfs_dir,
+			curstate, &lj_sched_fops);
+	
+	hrtimer_init(&curstate->out_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	curstate->out_timer.function = out_timer_cbk;
+	
+	/* Create the character devices */
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dportA",devid);
+	curstate->achr_device.name = tmpname;
+	curstate->achr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->achr_device.fops = &achr_ops;
+	
+
+	result = misc_register(&curstate->achr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register porta.\n");
+		goto err_intf;
+	}
+	else{
+		printk( KERN_INFO "Registered a porta char dev!\n");
+	}
+	result = lj_add_minor(curstate, &curstate->achr_device);
+	if(result)
+		goto err_intf;
+
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dportB",devid);
+	curstate->bchr_device.name = tmpname;
+	curstate->bchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->bchr_device.fops = &bchr_ops;
+
+
+	result = misc_register(&curstate->bchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register portb.\n");
+		goto err_rega;
+	}
+	else{
+		printk( KERN_INFO "Registered a portb char dev!\n");
+	}
+	result = lj_add_minor(curstate, &curstate->bchr_device);
+	if(result)
+		goto err_rega;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dportC",devid);
+	curstate->cchr_device.name = tmpname;
+	curstate->cchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->cchr_device.fops = &cchr_ops;
+
+
+	result = misc_register(&curstate->cchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register portc.\n");
+		goto err_regb;
+	}
+	else{
+		printk( KERN_INFO "Registered a portc char dev!\n");
+	}
+	result = lj_add_minor(curstate, &curstate->cchr_device);
+	if(result)
+		goto err_regb;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dstream",devid);
+	curstate->schr_device.name = tmpname;
+	curstate->schr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->schr_device.fops = &schr_ops;
+
+
+	result = misc_register(&curstate->schr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register stream port.\n");
+		goto err_regc;
+	}
+	else{
+		printk( KERN_INFO "Registered a stream char dev!\n");
+	}
+	result = lj_add_minor(curstate, &curstate->schr_device);
+	if(result)
+		goto err_regc;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dstatus",devid);
+	curstate->statchr_device.name = tmpname;
+	curstate->statchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->statchr_device.fops = &statchr_ops;
+
+
+	result = misc_register(&curstate->statchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register status port.\n");
+		goto err_regs;
+	}
+	result = lj_add_minor(curstate, &curstate->statchr_device);
+	if(result)
+		goto err_regs;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dscan",devid);
+	curstate->scanchr_device.name = tmpname;
+	curstate->scanchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->scanchr_device.fops = &scanchr_ops;
+
+
+	result = misc_register(&curstate->scanchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register scan port.\n");
+		goto err_regst;
+	}
+	result = lj_add_minor(curstate, &curstate->scanchr_device);
+	if(result)
+		goto err_regst;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%ddio",devid);
+	curstate->diochr_device.name = tmpname;
+	curstate->diochr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->diochr_device.fops = &diochr_ops;
+
+
+	result = misc_register(&curstate->diochr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register dio port.\n");
+		goto err_regscan;
+	}
+	result = lj_add_minor(curstate, &curstate->diochr_device);
+	if(result)
+		goto err_regscan;
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dcount",devid);
+	curstate->countchr_device.name = tmpname;
+	curstate->countchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->countchr_device.fops = &countchr_ops;
+
+
+	result = misc_register(&curstate->countchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register counter port.\n");
+		goto err_regdio;
+	}
+	result = lj_add_minor(curstate, &curstate->countchr_device);
+	if(result)
+		goto err_regdio;
+
+
+
+	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
+	sprintf(tmpname, "lab%dout",devid);
+	curstate->outchr_device.name = tmpname;
+	curstate->outchr_device.minor = MISC_DYNAMIC_MINOR;
+	curstate->outchr_device.fops = &outchr_ops;
+
+
+	result = misc_register(&curstate->outchr_device);
+  
+	if(result){
+		printk( KERN_INFO "Could not register out port.\n");
+		goto err_regcount;
+	}
+	result = lj_add_minor(curstate, &curstate->outchr_device);
+	if(result)
+		goto err_regcount;
+
+	result = lj_iio_register(curstate, intf);
+	if(result){
+		printk( KERN_INFO "Could not register IIO device: %d\n",
+			result);
+		goto err_regout;
+	}
+
+	return 0;
+  
+err_regout:
+	misc_deregister(&curstate->outchr_device);
+	kfree(curstate->outchr_device.name);
+err_regcount:
+	misc_deregister(&curstate->countchr_device);
+	kfree(curstate->countchr_device.name);
+err_regdio:
+	misc_deregister(&curstate->diochr_device);
+	kfree(curstate->diochr_device.name);
+err_regscan:
+	misc_deregister(&curstate->scanchr_device);
+	kfree(curstate->scanchr_device.name);
+err_regst:
+	misc_deregister(&curstate->statchr_device);
+	kfree(curstate->statchr_device.name);
+err_regs:
+	misc_deregister(&curstate->schr_device);
+	kfree(curstate->schr_device.name);
+err_regc:
+	misc_deregister(&curstate->cchr_device);
+	kfree(curstate->cchr_device.name);
+err_regb:
+	misc_deregister(&curstate->bchr_device);
+	kfree(curstate->bchr_device.name);
+err_rega:
+	misc_deregister(&curstate->achr_device);
+	kfree(curstate->achr_device.name);
+err_intf:
+	lj_tick_remove(curstate);
+	debugfs_remove_recursive(curstate->debugfs_dir);
+	lj_unpublish(curstate);
+err_pool:
+	lj_req_drain(curstate);
+	lj_pool_free(curstate);
+err_free:
+	usb_set_intfdata(intf, NULL);
+	lj_state_put(curstate);
+  
+error:
+	return -1;
+}
+
+static  void lj_disconnect(struct usb_interface *intf)
+{
+	struct lj_state *curstate;
+  
+	printk(KERN_INFO "ByeBye HW!!!\n");
+  
+	curstate = usb_get_intfdata(intf);
+
+	/* no new opens from here on */
+	lj_unpublish(curstate);
+  
+	/* stop IIO consumers first, so the buffer isn't running while
+	 * the requests fail. */
+	lj_iio_unregister(curstate);
+
+	/* fail anything still waiting for the hardware */
+	lj_req_drain(curstate);
+
+	/* let the portC read syscall know there was an error */
+	curstate->airlock = air_error;
+	lj_status_airlock(curstate);
+	wake_up_interruptible(&curstate->c_waitqueue);
+	wake_up(&curstate->b_waitqueue);
+	wake_up_interruptible(&curstate->out_waitqueue);
+	
+	/* stop the stream. The device is gone, so the urbs are just
+	 * killed without sending StreamStop. */
+	mutex_lock(&curstate->stream_mutex);
+	curstate->stream_err = -ENODEV;
+	lj_stream_stop(curstate);
+	mutex_unlock(&curstate->stream_mutex);
+	wake_up_interruptible(&curstate->s_waitqueue);
+
+	/* off the shared tick for good, so nothing can start the
+	 * periodic work again. The out timer checks req_dead before
+	 * rearming. */
+	lj_tick_remove(curstate);
+	lj_out_stop(curstate);
+	mutex_lock(&curstate->a_mutex);
+	lj_a_sw_stop(curstate);
+	mutex_unlock(&curstate->a_mutex);
+	mutex_lock(&curstate->b_sample_mutex);
+	curstate->b_sample_ms = 0;
+	mutex_unlock(&curstate->b_sample_mutex);
+  
+
+	misc_deregister(&curstate->achr_device);
+	kfree(curstate->achr_device.name);
+  
+	misc_deregister(&curstate->bchr_device);
+	kfree(curstate->bchr_device.name);
+  
+	misc_deregister(&curstate->cchr_device);
+	kfree(curstate->cchr_device.name);
+
+	misc_deregister(&curstate->schr_device);
+	kfree(curstate->schr_device.name);
+
+	misc_deregister(&curstate->statchr_device);
+	kfree(curstate->statchr_device.name);
+
+	misc_deregister(&curstate->scanchr_device);
+	kfree(curstate->scanchr_device.name);
+
+	misc_deregister(&curstate->diochr_device);
+	kfree(curstate->diochr_device.name);
+
+	misc_deregister(&curstate->countchr_device);
+	kfree(curstate->countchr_device.name);
+
+	misc_deregister(&curstate->outchr_device);
+	kfree(curstate->outchr_device.name);
+
+	debugfs_remove_recursive(curstate->debugfs_dir);
+	lj_pool_free(curstate);
+	usb_set_intfdata(intf, NULL);
+	/* open files keep the state around until they are closed */
+	lj_state_put(curstate);
+    
+}
+static int chr_open(struct inode *inode, struct file *file)
+{
+	struct lj_state *lj_state = NULL;
+	int subminor;
+
+	subminor = iminor(inode);
+  
+  
+	lj_state = lj_state_get(subminor);
+	if (!lj_state){
+		printk(KERN_INFO "Could not access labjack state!\n");
+		goto error;
+	}
+  
+	file->private_data = lj_state;
+	return 0;
+error:
+	return -ENODEV;
+}
+
+/* drops the reference chr_open took */
+static int chr_release(struct inode *inode, struct file *file)
+{
+	lj_state_put(file->private_data);
+	return 0;
+}
+
+/* maps the status page. It is only ever written by the driver, and
+ * outlives the mapping because the open file holds the state. */
+static int statchr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct lj_state *state = file->private_data;
+
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return vm_insert_page(vma, vma->vm_start,
+			virt_to_page(state->status));
+}
+
+/* sets req up as a PortStateWrite or PortDirWrite of the lines in
+ * mask */
+static void lj_dio_req(struct lj_req *req, int iotype, u32 mask, u32 bits)
+{
+	int i;
+
+	req->cmd[0] = iotype;
+	for(i = 0; i < 3; i++){
+		req->cmd[1 + i] = (mask >> (8*i)) & 0xff;	/* WriteMask */
+		req->cmd[4 + i] = (bits >> (8*i)) & 0xff;
+	}
+	req->cmd_len = 7;
+	req->resp_len = 0;
+}
+
+/* writes the levels and directions in dio, leaving out the lines the
+ * shadow says are already set. */
+static int lj_dio_set(struct lj_state *state, const struct lj_dio *dio)
+{
+	u32 lines = dio->state_mask | dio->dir_mask;
+	u32 busy;
+	u32 smask, dmask;
+	struct lj_req *sreq = NULL, *dreq = NULL;
+	int count = 0;
+	int result = 0;
+
+	if(lines & ~LJ_DIO_LINES)
+		return -EINVAL;
+
+	mutex_lock(&state->cfg_mutex);
+	busy = state->cfg_fio_analog | (state->cfg_eio_analog << 8) |
+		lj_timer_pins(state);
+	mutex_unlock(&state->cfg_mutex);
+	/* portA drives FIO4 */
+	if(lines & (busy | (1 << 4)))
+		return -EBUSY;
+
+	mutex_lock(&state->dio_mutex);
+	/* the out port may have moved its lines behind our back */
+	smask = dio->state_mask & ~(state->dio_state_known &
+				~ACCESS_ONCE(state->out_lines) &
+				~(state->dio_state ^ dio->state));
+	dmask = dio->dir_mask & ~(state->dio_dir_known &
+				~(state->dio_dir ^ dio->dir));
+
+	/* levels first, so a line made an output starts at its level.
+	 * Both go out in one packet. */
+	if(smask){
+		sreq = &state->dio_reqs[count++];
+		lj_dio_req(sreq, 27, smask, dio->state);
+	}
+	if(dmask){
+		dreq = &state->dio_reqs[count++];
+		lj_dio_req(dreq, 29, dmask, dio->dir);
+	}
+	if(count)
+		result = lj_req_sync_batch(state, state->dio_reqs, count,
+				LJ_PRIO_OUTPUT);
+
+	/* each request's result says whether it happened; a failed one
+	 * may or may not have */
+	if(sreq && sreq->result){
+		state->dio_state_known &= ~smask;
+	}
+	else if(sreq){
+		state->dio_state = (state->dio_state & ~smask) |
+			(dio->state & smask);
+		state->dio_state_known |= smask;
+	}
+	if(dreq && dreq->result){
+		state->dio_dir_known &= ~dmask;
+	}
+	else if(dreq){
+		state->dio_dir = (state->dio_dir & ~dmask) | (dio->dir & dmask);
+		state->dio_dir_known |= dmask;
+	}
+	mutex_unlock(&state->dio_mutex);
+	return result;
+}
+
+/* FIO, EIO and CIO bytes as one lj_dio mask */
+static u32 lj_dio_bits(const u8 *resp)
+{
+	return (resp[0] | (resp[1] << 8) | (resp[2] << 16)) & LJ_DIO_LINES;
+}
+
+/* reads every line's level and direction with PortStateRead and
+ * PortDirRead, and refreshes the shadow with them */
+static int lj_dio_get(struct lj_state *state, struct lj_dio *dio)
+{
+	struct lj_req *reqs = state->dio_reqs;
+	int result;
+	int i;
+
+	mutex_lock(&state->dio_mutex);
+	for(i = 0; i < 2; i++){
+		reqs[i].cmd[0] = i ? 28 : 26;
+		reqs[i].cmd_len = 1;
+		reqs[i].resp_len = 3;
+	}
+	result = lj_req_sync_batch(state, reqs, 2, LJ_PRIO_BULK);
+	if(!result){
+		state->dio_state = lj_dio_bits(reqs[0].resp);
+		state->dio_dir = lj_dio_bits(reqs[1].resp);
+		state->dio_state_known = LJ_DIO_LINES;
+		state->dio_dir_known = LJ_DIO_LINES;
+		dio->state_mask = LJ_DIO_LINES;
+		dio->state = state->dio_state;
+		dio->dir_mask = LJ_DIO_LINES;
+		dio->dir = state->dio_dir;
+	}
+	mutex_unlock(&state->dio_mutex);
+	return result;
+}
+
+/* forgets the shadow, after something the driver can't follow may
+ * have changed the lines */
+static void lj_dio_forget(struct lj_state *state)
+{
+	mutex_lock(&state->dio_mutex);
+	state->dio_state_known = 0;
+	state->dio_dir_known = 0;
+	mutex_unlock(&state->dio_mutex);
+}
+
+static long diochr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_dio dio;
+	int result;
+
+	switch(cmd){
+	case LJ_IOC_DIO_SET:
+		if(copy_from_user(&dio, (void __user *)arg, sizeof(dio)))
+			return -EFAULT;
+		return lj_dio_set(state, &dio);
+
+	case LJ_IOC_DIO_GET:
+		result = lj_dio_get(state, &dio);
+		if(result)
+			return result;
+		if(copy_to_user((void __user *)arg, &dio, sizeof(dio)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(state, cmd, arg);
+}
+
+/* changes the counter port's input timer and Counter1. If the U3
+ * won't take the new setup, the old one is put back. */
+static int lj_count_config(struct lj_state *state,
+			const struct lj_count_config *cfg)
+{
+	int old_mode, old_counter;
+	int result;
+
+	switch(cfg->timer_mode){
+	case LJ_COUNT_TIMER_OFF:
+	case LJ_COUNT_PERIOD_RISING:
+	case LJ_COUNT_PERIOD_FALLING:
+	case LJ_COUNT_DUTY:
+	case LJ_COUNT_EDGES:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if(cfg->counter > 1)
+		return -EINVAL;
+
+	mutex_lock(&state->cfg_mutex);
+	old_mode = state->tmr_in_mode;
+	old_counter = state->tmr_counter;
+	state->tmr_in_mode = cfg->timer_mode;
+	state->tmr_counter = cfg->counter;
+	/* the scan port may have made the pins analog */
+	if(lj_timer_pins(state) & state->cfg_fio_analog)
+		result = -EBUSY;
+	else
+		result = lj_timers_apply(state);
+	if(result){
+		state->tmr_in_mode = old_mode;
+		state->tmr_counter = old_counter;
+		if(result != -EBUSY)
+			lj_timers_apply(state);
+	}
+	mutex_unlock(&state->cfg_mutex);
+	return result;
+}
+
+/* reads the input timer and Counter1 in one packet, and zeroes their
+ * edge counts if reset is set */
+static int lj_count_read(struct lj_state *state, struct lj_count_record *rec,
+			int reset)
+{
+	struct lj_req *reqs = state->tmr_reqs;
+	int timer = -1;
+	int count = 0;
+	int result;
+
+	memset(rec, 0, sizeof(*rec));
+	mutex_lock(&state->cfg_mutex);
+	if(!state->tmr_in_mode && !state->tmr_counter){
+		result = -EINVAL;
+		goto out;
+	}
+
+	if(state->tmr_in_mode){
+		timer = count++;
+		reqs[timer].cmd[0] = 42 + 2*state->tmr_a; /* Timer0 or 1 */
+		reqs[timer].cmd[1] = reset ? 0x02 : 0x00; /* UpdateReset */
+		reqs[timer].cmd[2] = 0;
+		reqs[timer].cmd[3] = 0;
+		reqs[timer].cmd_len = 4;
+		reqs[timer].resp_len = 4;
+	}
+	if(state->tmr_counter){
+		reqs[count].cmd[0] = 55;	/* Counter1 */
+		reqs[count].cmd[1] = reset ? 0x01 : 0x00;
+		reqs[count].cmd_len = 2;
+		reqs[count].resp_len = 4;
+		count++;
+	}
+
+	rec->timestamp_ns = ktime_get_ns();
+	result = lj_req_sync_batch(state, reqs, count, LJ_PRIO_BULK);
+	if(result)
+		goto out;
+
+	if(timer >= 0)
+		rec->timer = get_unaligned_le32(reqs[timer].resp);
+	if(state->tmr_counter)
+		rec->counter = get_unaligned_le32(reqs[count - 1].resp);
+	rec->tick_ns = NSEC_PER_USEC * (state->tmr_a ? state->tmr_a_div : 1);
+	rec->timer_mode = state->tmr_in_mode;
+	rec->counter_on = state->tmr_counter;
+out:
+	mutex_unlock(&state->cfg_mutex);
+	return result;
+}
+
+static ssize_t countchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_count_record rec;
+	int result;
+
+	if(size < sizeof(rec))
+		return -EINVAL;
+
+	result = lj_count_read(state, &rec, 0);
+	if(result)
+		return result;
+	if(copy_to_user(buf, &rec, sizeof(rec)))
+		return -EFAULT;
+	return sizeof(rec);
+}
+
+static long countchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_count_config cfg;
+	struct lj_count_record rec;
+	int result;
+
+	switch(cmd){
+	case LJ_IOC_COUNT_CONFIG:
+		if(copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		return lj_count_config(state, &cfg);
+
+	case LJ_IOC_COUNT_READ_RESET:
+		result = lj_count_read(state, &rec, 1);
+		if(result)
+			return result;
+		if(copy_to_user((void __user *)arg, &rec, sizeof(rec)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(state, cmd, arg);
+}
+
+/* converts uV into a DAC's 8 bit value with its calibration */
+static u8 lj_out_dac(struct lj_state *state, int dac, s32 uv)
+{
+	s64 bits;
+
+	/* the DACs top out under 5V, and this keeps the product in range */
+	uv = clamp_t(s32, uv, 0, 5 * USEC_PER_SEC);
+	bits = div_s64(state->cal.dac_slope[dac] * uv, USEC_PER_SEC) +
+		state->cal.dac_offset[dac];
+
+	/* round to the nearest step */
+	bits = (bits + (LJ_CAL_VOLT >> 1)) >> 32;
+	return clamp_t(s64, bits, 0, 255);
+}
+
+/* checks a step written to the out port and turns it into a ring
+ * entry. Called with out_mutex held. */
+static int lj_out_convert(struct lj_state *state,
+			const struct lj_out_step *step, struct lj_out_ent *ent)
+{
+	u32 busy;
+
+	ent->time_ns = step->time_ns;
+	ent->type = step->type;
+	switch(step->type){
+	case LJ_OUT_DAC0:
+	case LJ_OUT_DAC1:
+		ent->mask = 0;
+		ent->bits = lj_out_dac(state, step->type, step->value);
+		return 0;
+
+	case LJ_OUT_DIO:
+		if(!step->mask || (step->mask & ~LJ_DIO_LINES))
+			return -EINVAL;
+		mutex_lock(&state->cfg_mutex);
+		busy = state->cfg_fio_analog | (state->cfg_eio_analog << 8) |
+			lj_timer_pins(state);
+		mutex_unlock(&state->cfg_mutex);
+		/* portA drives FIO4 */
+		if(step->mask & (busy | (1 << 4)))
+			return -EBUSY;
+		ent->mask = step->mask;
+		ent->bits = step->value & step->mask;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* starts the playback timer if playback is on and it isn't already
+ * going. Called with out_lock held. */
+static void lj_out_arm(struct lj_state *state)
+{
+	if(!state->out_running || state->out_armed)
+		return;
+	/* req_lock keeps this from racing with disconnect */
+	spin_lock(&state->req_lock);
+	if(!state->req_dead){
+		state->out_armed = 1;
+		hrtimer_start(&state->out_timer, ktime_get(),
+			HRTIMER_MODE_ABS);
+	}
+	spin_unlock(&state->req_lock);
+}
+
+/* out_req completed, so the next tick can send */
+static void out_req_done(struct lj_req *req)
+{
+	struct lj_state *state = req->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	state->out_busy = 0;
+	if(req->result)
+		state->out_stats.errors++;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+}
+
+/* takes every step due by the end of this tick out of the ring, and
+ * merges them into one Feedback request in out_req. Returns the
+ * length of its IOTypes, 0 if nothing was due. Called with out_lock
+ * held. */
+static int lj_out_collect(struct lj_state *state, u64 now)
+{
+	struct lj_req *req = &state->out_req;
+	struct lj_out_ent *ent;
+	int dac[2] = {-1, -1};
+	u32 mask = 0, bits = 0;
+	u64 due;
+	int len = 0;
+	int i;
+
+	while(state->out_tail != state->out_head){
+		ent = &state->out_ring[state->out_tail & (LJ_OUT_RING - 1)];
+		due = state->out_t0 + ent->time_ns;
+		if(due > now + LJ_OUT_TICK_NS)
+			break;
+		if(now >= due + LJ_OUT_TICK_NS){
+			state->out_stats.late++;
+			if(now - due > state->out_stats.late_max_ns)
+				state->out_stats.late_max_ns = now - due;
+		}
+		if(ent->type == LJ_OUT_DIO){
+			mask |= ent->mask;
+			bits = (bits & ~ent->mask) | ent->bits;
+		}
+		else
+			dac[ent->type] = ent->bits;
+		state->out_tail++;
+		state->out_stats.played++;
+	}
+
+	for(i = 0; i < 2; i++){
+		if(dac[i] < 0)
+			continue;
+		req->cmd[len++] = 34 + i;	/* DAC0 or DAC1, 8 bit */
+		req->cmd[len++] = dac[i];
+	}
+	if(mask){
+		req->cmd[len++] = 27;		/* PortStateWrite */
+		for(i = 0; i < 3; i++)
+			req->cmd[len++] = (mask >> (8*i)) & 0xff;
+		for(i = 0; i < 3; i++)
+			req->cmd[len++] = (bits >> (8*i)) & 0xff;
+	}
+	if(!len)
+		return 0;
+
+	req->flags = 0;
+	req->prio = LJ_PRIO_OUTPUT;
+	req->cmd_len = len;
+	req->resp_len = 0;
+	req->done = out_req_done;
+	req->context = state;
+	state->out_busy = 1;
+	state->out_stats.packets++;
+	return len;
+}
+
+/* sends the steps that are due, and sleeps until the next one is. If
+ * the last packet hasn't come back yet, the steps wait a tick and go
+ * out together with the next ones. */
+static enum hrtimer_restart out_timer_cbk(struct hrtimer *timer)
+{
+	struct lj_state *state =
+		container_of(timer, struct lj_state, out_timer);
+	struct lj_out_ent *ent;
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+	u64 next = 0;
+	int len = 0;
+	int result;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	if(state->out_running && !state->out_busy){
+		len = lj_out_collect(state, now);
+		/* the writer didn't keep up */
+		if(len && state->out_tail == state->out_head)
+			state->out_stats.underruns++;
+	}
+	if(state->out_running && state->out_tail != state->out_head){
+		ent = &state->out_ring[state->out_tail & (LJ_OUT_RING - 1)];
+		next = max(state->out_t0 + ent->time_ns, now + LJ_OUT_TICK_NS);
+	}
+	if(!next)
+		state->out_armed = 0;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+
+	if(len){
+		result = lj_req_submit(state, &state->out_req);
+		if(result){
+			spin_lock_irqsave(&state->out_lock, flags);
+			state->out_busy = 0;
+			state->out_stats.errors++;
+			spin_unlock_irqrestore(&state->out_lock, flags);
+		}
+		/* there is room in the ring again */
+		wake_up_interruptible(&state->out_waitqueue);
+	}
+
+	if(!next)
+		return HRTIMER_NORESTART;
+	hrtimer_set_expires(timer, ns_to_ktime(next));
+	return HRTIMER_RESTART;
+}
+
+/* adds a step to the ring, if there is room. Returns -EAGAIN if there
+ * isn't. Called with out_mutex held. */
+static int lj_out_push(struct lj_state *state, const struct lj_out_ent *ent)
+{
+	unsigned long flags;
+	int result = 0;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	if(ent->time_ns < state->out_last_ns){
+		result = -EINVAL;
+		goto out;
+	}
+	if(state->out_head - state->out_tail >= LJ_OUT_RING){
+		result = -EAGAIN;
+		goto out;
+	}
+	state->out_ring[state->out_head & (LJ_OUT_RING - 1)] = *ent;
+	state->out_head++;
+	state->out_last_ns = ent->time_ns;
+	state->out_lines |= ent->mask;
+	lj_out_arm(state);
+out:
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	return result;
+}
+
+static int lj_out_room(struct lj_state *state)
+{
+	unsigned long flags;
+	int room;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	room = state->out_head - state->out_tail < LJ_OUT_RING;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	return room || state->req_dead;
+}
+
+/* queues the steps in buf. Waits for room for the first one, and
+ * queues as many of the rest as fit. */
+static ssize_t outchr_write(struct file *file, const char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_out_step step;
+	struct lj_out_ent ent;
+	size_t done = 0;
+	int result = 0;
+
+	if(size < sizeof(step))
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&state->out_mutex))
+		return -ERESTARTSYS;
+	while(done + sizeof(step) <= size){
+		if(copy_from_user(&step, buf + done, sizeof(step))){
+			result = -EFAULT;
+			break;
+		}
+		result = lj_out_convert(state, &step, &ent);
+		if(result)
+			break;
+		while((result = lj_out_push(state, &ent)) == -EAGAIN){
+			if(done || (file->f_flags & O_NONBLOCK))
+				break;
+			if(wait_event_interruptible(state->out_waitqueue,
+					lj_out_room(state))){
+				result = -ERESTARTSYS;
+				break;
+			}
+			if(state->req_dead){
+				result = -ENODEV;
+				break;
+			}
+		}
+		if(result)
+			break;
+		done += sizeof(step);
+	}
+	mutex_unlock(&state->out_mutex);
+
+	return done ? done : result;
+}
+
+static unsigned int outchr_poll(struct file *file, poll_table *wait)
+{
+	struct lj_state *state = file->private_data;
+
+	poll_wait(file, &state->out_waitqueue, wait);
+	if(state->req_dead)
+		return POLLERR;
+	if(lj_out_room(state))
+		return POLLOUT | POLLWRNORM;
+	return 0;
+}
+
+static int lj_out_start(struct lj_state *state)
+{
+	unsigned long flags;
+	int result = 0;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	if(state->out_running){
+		result = -EBUSY;
+		goto out;
+	}
+	memset(&state->out_stats, 0, sizeof(state->out_stats));
+	state->out_t0 = ktime_get_ns();
+	state->out_running = 1;
+	lj_out_arm(state);
+out:
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	return result;
+}
+
+/* stops playback and empties the ring. The dio port can trust its
+ * shadow of the lines the steps set again once it has read them. */
+static void lj_out_stop(struct lj_state *state)
+{
+	unsigned long flags;
+	u32 lines;
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	state->out_running = 0;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	hrtimer_cancel(&state->out_timer);
+
+	spin_lock_irqsave(&state->out_lock, flags);
+	state->out_armed = 0;
+	state->out_tail = state->out_head;
+	state->out_last_ns = 0;
+	lines = state->out_lines;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	wake_up_interruptible(&state->out_waitqueue);
+
+	mutex_lock(&state->dio_mutex);
+	state->dio_state_known &= ~lines;
+	spin_lock_irqsave(&state->out_lock, flags);
+	state->out_lines = 0;
+	spin_unlock_irqrestore(&state->out_lock, flags);
+	mutex_unlock(&state->dio_mutex);
+}
+
+static long outchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_out_stats st;
+	unsigned long flags;
+
+	switch(cmd){
+	case LJ_IOC_OUT_START:
+		return lj_out_start(state);
+
+	case LJ_IOC_OUT_STOP:
+		lj_out_stop(state);
+		return 0;
+
+	case LJ_IOC_OUT_STATS:
+		spin_lock_irqsave(&state->out_lock, flags);
+		st = state->out_stats;
+		st.queued = state->out_head - state->out_tail;
+		st.running = state->out_running;
+		spin_unlock_irqrestore(&state->out_lock, flags);
+		if(copy_to_user((void __user *)arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(state, cmd, arg);
+}
+
+/* runs a vector of Feedback ops from userspace as one batch, so they
+ * share packets, and copies every result back at once. */
+static long lj_feedback(struct lj_state *state,
+			struct lj_feedback __user *uarg)
+{
+	struct lj_feedback fb;
+	struct lj_fb_op *ops;
+	struct lj_req *reqs;
+	void __user *uops;
+	long result;
+	int i;
+
+	if(copy_from_user(&fb, uarg, sizeof(fb)))
+		return -EFAULT;
+	if(!fb.count || fb.count > LJ_FB_MAX_OPS)
+		return -EINVAL;
+	uops = (void __user *)(unsigned long)fb.ops;
+
+	ops = memdup_user(uops, fb.count * sizeof(*ops));
+	if(IS_ERR(ops))
+		return PTR_ERR(ops);
+	reqs = kcalloc(fb.count, sizeof(*reqs), GFP_KERNEL);
+	if(!reqs){
+		result = -ENOMEM;
+		goto out;
+	}
+
+	for(i = 0; i < fb.count; i++){
+		if(!ops[i].cmd_len || ops[i].cmd_len > LJ_FB_MAX_CMD ||
+			ops[i].resp_len > LJ_FB_MAX_RESP ||
+			ops[i].frames > ops[i].cmd_len){
+			result = -EINVAL;
+			goto out;
+		}
+		memcpy(reqs[i].cmd, ops[i].cmd, ops[i].cmd_len);
+		reqs[i].cmd_len = ops[i].cmd_len;
+		reqs[i].resp_len = ops[i].resp_len;
+		reqs[i].frames = ops[i].frames;
+		/* resp_len comes from the caller, who can only be wrong
+		 * about its own ops */
+		reqs[i].flags = LJ_REQ_OWN;
+	}
+
+	result = lj_req_sync_batch(state, reqs, fb.count, LJ_PRIO_BULK);
+	/* the ops may have changed any line */
+	lj_dio_forget(state);
+
+	for(i = 0; i < fb.count; i++){
+		ops[i].result = reqs[i].result;
+		memcpy(ops[i].resp, reqs[i].resp, ops[i].resp_len);
+	}
+	if(copy_to_user(uops, ops, fb.count * sizeof(*ops)))
+		result = -EFAULT;
+out:
+	kfree(reqs);
+	kfree(ops);
+	return result;
+}
+
+/* copies out a class's stats, and starts its maximums over */
+static void lj_sched_stats(struct lj_state *state, struct lj_sched_stats *st)
+{
+	struct lj_sched *sch = &state->sched[st->prio];
+	unsigned long flags;
+
+	spin_lock_irqsave(&state->req_lock, flags);
+	st->depth = sch->depth;
+	st->max_depth = sch->max_depth;
+	st->rate = sch->rate;
+	st->burst = sch->burst;
+	st->reserved = 0;
+	st->sent = sch->sent;
+	st->throttled = sch->throttled;
+	st->wait_ns_total = sch->wait_ns_total;
+	st->wait_ns_max = sch->wait_ns_max;
+	sch->max_depth = sch->depth;
+	sch->wait_ns_max = 0;
+	spin_unlock_irqrestore(&state->req_lock, flags);
+}
+
+/* ioctls every port understands. Each port's ioctl ends up here for
+ * the commands it doesn't know itself. */
+static long lj_common_ioctl(struct lj_state *state, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_sched_limit limit;
+	struct lj_sched_stats st;
+	unsigned long flags;
+
+	switch(cmd){
+	case LJ_IOC_FEEDBACK:
+		return lj_feedback(state, (struct lj_feedback __user *)arg);
+
+	case LJ_IOC_SCHED_LIMIT:
+		if(copy_from_user(&limit, (void __user *)arg, sizeof(limit)))
+			return -EFAULT;
+		if(limit.prio >= LJ_NUM_PRIO || !limit.burst)
+			return -EINVAL;
+		if(limit.rate > NSEC_PER_SEC)
+			return -EINVAL;
+		spin_lock_irqsave(&state->req_lock, flags);
+		lj_sched_limit(&state->sched[limit.prio], limit.rate,
+			limit.burst);
+		spin_unlock_irqrestore(&state->req_lock, flags);
+		/* a class that was held back may be able to go now */
+		lj_req_kick(state);
+		return 0;
+
+	case LJ_IOC_SCHED_STATS:
+		if(copy_from_user(&st, (void __user *)arg, sizeof(st)))
+			return -EFAULT;
+		if(st.prio >= LJ_NUM_PRIO)
+			return -EINVAL;
+		lj_sched_stats(state, &st);
+		if(copy_to_user((void __user *)arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+/* checks one channel of a scan list, and adds the FIO and EIO lines
+ * it reads to the analog masks. */
+static int lj_scan_check(const struct lj_ain *ain, u8 *fio, u8 *eio)
+{
+	int chans[2] = {ain->pchannel, ain->nchannel};
+	int i;
+
+	if(ain->flags & ~(LJ_AIN_LONG_SETTLING | LJ_AIN_QUICK_SAMPLE))
+		return -EINVAL;
+	if(ain->pchannel > 15 && ain->pchannel != 30 && ain->pchannel != 31)
+		return -EINVAL;
+	if(ain->nchannel > 15 && (ain->nchannel < 30 || ain->nchannel > 32))
+		return -EINVAL;
+
+	for(i = 0; i < 2; i++){
+		/* portA drives FIO4 */
+		if(chans[i] == 4)
+			return -EBUSY;
+		if(chans[i] < 8)
+			*fio |= 1 << chans[i];
+		else if(chans[i] < 16)
+			*eio |= 1 << (chans[i] - 8);
+	}
+	return 0;
+}
+
+/* the pchannel byte of an AIN IOType for ain, with its flags in bits
+ * 6 and 7 */
+static int lj_scan_pchannel(const struct lj_ain *ain)
+{
+	int pchannel = ain->pchannel;
+
+	if(ain->flags & LJ_AIN_LONG_SETTLING)
+		pchannel |= 1 << 6;
+	if(ain->flags & LJ_AIN_QUICK_SAMPLE)
+		pchannel |= 1 << 7;
+	return pchannel;
+}
+
+/* switches FIO and EIO lines to analog with ConfigIO, if they aren't
+ * already. They stay analog from then on. */
+static int lj_analog_enable(struct lj_state *state, u8 fio, u8 eio)
+{
+	u8 old_fio, old_eio;
+	int result = 0;
+
+	mutex_lock(&state->cfg_mutex);
+	old_fio = state->cfg_fio_analog;
+	old_eio = state->cfg_eio_analog;
+	/* the counter port's pins */
+	if(fio & lj_timer_pins(state))
+		result = -EBUSY;
+	else if((fio & ~old_fio) || (eio & ~old_eio)){
+		state->cfg_fio_analog |= fio;
+		state->cfg_eio_analog |= eio;
+		result = lj_config_io(state);
+		if(result){
+			state->cfg_fio_analog = old_fio;
+			state->cfg_eio_analog = old_eio;
+		}
+	}
+	mutex_unlock(&state->cfg_mutex);
+	return result;
+}
+
+/* replaces the scan list. Lines it reads are made analog first. */
+static int lj_scan_set(struct lj_state *state, const struct lj_scan_list *list)
+{
+	u8 fio = 0;
+	u8 eio = 0;
+	int result = 0;
+	int i;
+
+	if(list->count > LJ_SCAN_MAX)
+		return -EINVAL;
+	for(i = 0; i < list->count; i++){
+		result = lj_scan_check(&list->ain[i], &fio, &eio);
+		if(result)
+			return result;
+	}
+
+	result = lj_analog_enable(state, fio, eio);
+	if(result)
+		return result;
+
+	mutex_lock(&state->scan_mutex);
+	state->scan = *list;
+	for(i = 0; i < list->count; i++)
+		state->scan_cal[i] = lj_cal_lookup(state,
+			list->ain[i].pchannel, list->ain[i].nchannel);
+	mutex_unlock(&state->scan_mutex);
+	return 0;
+}
+
+/* reads every channel in the scan list. The AIN requests are packed
+ * into as few Feedback packets as they fit, so up to 19 channels cost
+ * one round trip. */
+static ssize_t scanchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_scan_record rec;
+	int result;
+	int i;
+
+	if(size < sizeof(rec))
+		return -EINVAL;
+
+	memset(&rec, 0, sizeof(rec));
+	mutex_lock(&state->scan_mutex);
+	rec.count = state->scan.count;
+	if(!rec.count){
+		result = -EINVAL;
+		goto out;
+	}
+	for(i = 0; i < rec.count; i++)
+		lj_ain_req(&state->scan_reqs[i],
+			lj_scan_pchannel(&state->scan.ain[i]),
+			state->scan.ain[i].nchannel);
+
+	rec.timestamp_ns = ktime_get_ns();
+	result = lj_req_sync_batch(state, state->scan_reqs, rec.count,
+			LJ_PRIO_BULK);
+	if(result)
+		goto out;
+	for(i = 0; i < rec.count; i++)
+		rec.value[i] = state->scan_reqs[i].resp[0] +
+			(state->scan_reqs[i].resp[1] << 8);
+	lj_cal_convert(state->scan_cal, rec.value, rec.calibrated, rec.count);
+	rec.seq = state->scan_seq++;
+out:
+	mutex_unlock(&state->scan_mutex);
+	if(result)
+		return result;
+
+	if(copy_to_user(buf, &rec, sizeof(rec)))
+		return -EFAULT;
+	return sizeof(rec);
+}
+
+static long scanchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_state *state = file->private_data;
+	struct lj_scan_list list;
+
+	switch(cmd){
+	case LJ_IOC_SCAN_SET:
+		if(copy_from_user(&list, (void __user *)arg, sizeof(list)))
+			return -EFAULT;
+		return lj_scan_set(state, &list);
+
+	case LJ_IOC_SCAN_GET:
+		mutex_lock(&state->scan_mutex);
+		list = state->scan;
+		mutex_unlock(&state->scan_mutex);
+		if(copy_to_user((void __user *)arg, &list, sizeof(list)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(state, cmd, arg);
+}
+
+/* finds a labjack by the N in labN, and takes a reference on it.
+ * Returns NULL if there is none. */
+static struct lj_state *lj_state_find(int devid)
+{
+	struct lj_state *state;
+
+	rcu_read_lock();
+	state = idr_find(&lj_idr, devid);
+	if(state && !kref_get_unless_zero(&state->kref))
+		state = NULL;
+	rcu_read_unlock();
+	return state;
+}
+
+/* a tick's reads are all back, or were never sent. Called with the
+ * group's lock held. */
+static void lj_group_emit(struct lj_group *group)
+{
+	if(!kfifo_put(&group->records, group->rec)){
+		group->missed++;
+		return;
+	}
+	group->missed = 0;
+	wake_up_interruptible(&group->waitqueue);
+}
+
+/* drops one of the reads the tick is waiting for */
+static void lj_group_put(struct lj_group *group)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&group->lock, flags);
+	if(!--group->outstanding){
+		lj_group_emit(group);
+		wake_up(&group->idle_waitqueue);
+	}
+	spin_unlock_irqrestore(&group->lock, flags);
+}
+
+/* fills in a channel's sample */
+static void lj_group_chan_done(struct lj_group_chan *chan, int result)
+{
+	struct lj_group *group = chan->group;
+	struct lj_group_sample *sample = &group->rec.sample[chan->index];
+	unsigned long flags;
+	u16 raw;
+
+	spin_lock_irqsave(&group->lock, flags);
+	sample->done_ns = ktime_get_ns();
+	sample->result = result;
+	if(!result){
+		raw = chan->req.resp[0] + (chan->req.resp[1] << 8);
+		sample->raw = raw;
+		lj_cal_convert(&chan->cal, &raw, &sample->calibrated, 1);
+	}
+	spin_unlock_irqrestore(&group->lock, flags);
+	lj_group_put(group);
+}
+
+static void group_req_done(struct lj_req *req)
+{
+	lj_group_chan_done(req->context, req->result);
+}
+
+/* sends every channel's read, back to back so the labjacks see them
+ * as close together as they can. If the last tick's reads are still
+ * out, this tick is skipped. */
+static enum hrtimer_restart group_timer_cbk(struct hrtimer *timer)
+{
+	struct lj_group *group = container_of(timer, struct lj_group, timer);
+	struct lj_group_chan *chan;
+	unsigned long flags;
+	u64 overruns;
+	int result;
+	int i;
 
-	result = usb_bulk_msg(curstate->usb_device, 
-			usb_rcvbulkpipe(curstate->usb_device, 2),
-			rcv_packet, RCVSIZE, &sent_len, 5);
-	if(result){
-		printk("Could not receive bulk message to configure IO.\n");
-		goto err_hwlock;
+	spin_lock_irqsave(&group->lock, flags);
+	if(group->outstanding){
+		group->missed++;
+		spin_unlock_irqrestore(&group->lock, flags);
+		goto out;
 	}
-	if(rcv_packet[0] == 0xb8 && rcv_packet[1] == 0xb8){
-		printk("We got a bad checksum. Orig packet was:\n");
-		print_arr(config_packet, CFGSIZE);
-		printk("\n");
-		goto err_hwlock;
+	/* one extra, so the record can't go out until all are sent */
+	group->outstanding = group->count + 1;
+	memset(&group->rec, 0, sizeof(group->rec));
+	group->rec.tick = group->tick++;
+	group->rec.count = group->count;
+	group->rec.missed = group->missed;
+	group->rec.tick_ns = ktime_get_ns();
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	for(i = 0; i < group->count; i++){
+		chan = &group->chans[i];
+		result = lj_req_submit(chan->state, &chan->req);
+		if(result)
+			lj_group_chan_done(chan, result);
 	}
-	if(rcv_packet[6])
-	{
-		printk("error in configio: %d\n", rcv_packet[6]);
-		goto err_hwlock;
+	lj_group_put(group);
+
+out:
+	/* steps from the last expiry, so the ticks don't drift */
+	overruns = hrtimer_forward_now(timer, group->period);
+	if(overruns > 1){
+		spin_lock_irqsave(&group->lock, flags);
+		group->missed += overruns - 1;
+		spin_unlock_irqrestore(&group->lock, flags);
 	}
+	return HRTIMER_RESTART;
+}
 
+/* stops the group's timer, waits for its last reads, and lets go of
+ * its labjacks. Called with the group's mutex held. */
+/* true once no tick is outstanding. Taking the lock means the last
+ * lj_group_put is done with the group, not just done counting. */
+static int lj_group_idle(struct lj_group *group)
+{
+	unsigned long flags;
+	int idle;
 
-	/* now set FIO4 as a digital output */
-	result = usb_bulk_msg(curstate->usb_device, 
-			usb_sndbulkpipe(curstate->usb_device, 1),
-			dig_packet, CFGSIZE, &sent_len, 5);
-  
+	spin_lock_irqsave(&group->lock, flags);
+	idle = !group->outstanding;
+	spin_unlock_irqrestore(&group->lock, flags);
+	return idle;
+}
 
-	if(result){
-		printk("Could not send bulk message to configure FIO4.\n");
-		goto err_hwlock;
-	}
+static void lj_group_stop(struct lj_group *group)
+{
+	int i;
 
-	result = usb_bulk_msg(curstate->usb_device, 
-			usb_rcvbulkpipe(curstate->usb_device, 2),
-			digrcv_packet, DIGRCVSIZE, &sent_len, 5);
-	if(result){
-		printk("Could not receive bulk message to configure IO.\n");
-		goto err_hwlock;
-	}
-	if(digrcv_packet[0] == 0xb8 && digrcv_packet[1] == 0xb8){
-		printk("We got a bad checksum. Orig packet was:\n");
-		print_arr(dig_packet, CFGSIZE);
-		printk("\n");
-		goto err_hwlock;
-	}
-	if(rcv_packet[6])
-	{
-		printk("error in configio: %d\n", digrcv_packet[6]);
-		goto err_hwlock;
+	hrtimer_cancel(&group->timer);
+	wait_event(group->idle_waitqueue, lj_group_idle(group));
+	for(i = 0; i < group->count; i++)
+		lj_state_put(group->chans[i].state);
+	group->count = 0;
+}
+
+/* replaces the group's channels and starts it ticking */
+static int lj_group_set(struct lj_group *group,
+			const struct lj_group_config *cfg)
+{
+	const struct lj_group_member *member;
+	struct lj_group_chan *chan;
+	unsigned long flags;
+	u8 fio, eio;
+	int result = 0;
+	int i;
+
+	if(cfg->count > LJ_GROUP_MAX)
+		return -EINVAL;
+	if(cfg->period_us && (cfg->period_us < LJ_GROUP_MIN_PERIOD_US ||
+				!cfg->count))
+		return -EINVAL;
+
+	mutex_lock(&group->mutex);
+	lj_group_stop(group);
+	if(!cfg->period_us)
+		goto out;
+
+	for(i = 0; i < cfg->count; i++){
+		member = &cfg->member[i];
+		chan = &group->chans[i];
+		fio = 0;
+		eio = 0;
+		result = lj_scan_check(&member->ain, &fio, &eio);
+		if(result)
+			break;
+		chan->state = lj_state_find(member->devid);
+		if(!chan->state){
+			result = -ENODEV;
+			break;
+		}
+		group->count++;
+		result = lj_analog_enable(chan->state, fio, eio);
+		if(result)
+			break;
+
+		chan->group = group;
+		chan->index = i;
+		chan->cal = lj_cal_lookup(chan->state, member->ain.pchannel,
+					member->ain.nchannel);
+		lj_ain_req(&chan->req, lj_scan_pchannel(&member->ain),
+			member->ain.nchannel);
+		chan->req.flags = 0;
+		chan->req.prio = LJ_PRIO_POLL;
+		chan->req.done = group_req_done;
+		chan->req.context = chan;
 	}
-  
-	minor = insert_state_table(curstate);
-	if(minor < 0){
-		printk(KERN_INFO
-			"could not add usb_interface to interface table!\n");
-		goto err_hwlock;
+	if(result){
+		lj_group_stop(group);
+		goto out;
 	}
 
-	devid = minor - MINOR_START;
-	
-	/* create the portC timer callback */
-	init_timer(&curstate->c_poll_timer);
+	spin_lock_irqsave(&group->lock, flags);
+	group->tick = 0;
+	group->missed = 0;
+	kfifo_reset(&group->records);
+	spin_unlock_irqrestore(&group->lock, flags);
+	group->period = ns_to_ktime((u64)cfg->period_us * NSEC_PER_USEC);
+	hrtimer_start(&group->timer, group->period, HRTIMER_MODE_REL);
+out:
+	mutex_unlock(&group->mutex);
+	return result;
+}
 
-	curstate->c_poll_timer.expires = jiffies + LJ_PORTC_FREQ;
-	curstate->c_poll_timer.function = c_timer_cbk;
-	curstate->c_poll_timer.data = (unsigned long)curstate;
-	add_timer(&curstate->c_poll_timer);
+static int groupchr_open(struct inode *inode, struct file *file)
+{
+	struct lj_group *group;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if(!group)
+		return -ENOMEM;
+	spin_lock_init(&group->lock);
+	mutex_init(&group->mutex);
+	INIT_KFIFO(group->records);
+	init_waitqueue_head(&group->waitqueue);
+	init_waitqueue_head(&group->idle_waitqueue);
+	hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	group->timer.function = group_timer_cbk;
+	file->private_data = group;
+	return 0;
+}
 
-	init_timer(&curstate->a_poll_timer);
-	curstate->a_poll_timer.function = a_timer_cbk;
-	curstate->a_poll_timer.data = (unsigned long)curstate;
-	
-	/* Create the character devices */
+static int groupchr_release(struct inode *inode, struct file *file)
+{
+	struct lj_group *group = file->private_data;
 
-	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
-	sprintf(tmpname, "lab%dportA",devid);
-	curstate->achr_device.name = tmpname;
-	curstate->achr_device.minor = minor; /* a's minor is start minor*/
-	curstate->achr_device.fops = &achr_ops;
-	
+	mutex_lock(&group->mutex);
+	lj_group_stop(group);
+	mutex_unlock(&group->mutex);
+	kfree(group);
+	return 0;
+}
 
-	result = misc_register(&curstate->achr_device);
-  
-	if(result){
-		printk( KERN_INFO "Could not register porta.\n");
-		goto err_intf;
-	}
-	else{
-		printk( KERN_INFO "Registered a porta char dev!\n");
-	}
+static int lj_group_empty(struct lj_group *group)
+{
+	unsigned long flags;
+	int empty;
 
+	spin_lock_irqsave(&group->lock, flags);
+	empty = kfifo_is_empty(&group->records);
+	spin_unlock_irqrestore(&group->lock, flags);
+	return empty;
+}
 
+/* returns as many records as fit, or waits for one if there are none */
+static ssize_t groupchr_read(struct file *file, char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct lj_group *group = file->private_data;
+	struct lj_group_record rec;
+	unsigned long flags;
+	size_t done = 0;
+	int found;
 
-	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
-	sprintf(tmpname, "lab%dportB",devid);
-	curstate->bchr_device.name = tmpname;
-	curstate->bchr_device.minor = minor + 1; /* b's minor is start
-						  * minor + 1 */
-	curstate->bchr_device.fops = &bchr_ops;
+	if(size < sizeof(rec))
+		return -EINVAL;
 
+	while(lj_group_empty(group)){
+		if(file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(group->waitqueue,
+				!lj_group_empty(group)))
+			return -ERESTARTSYS;
+	}
 
-	result = misc_register(&curstate->bchr_device);
-  
-	if(result){
-		printk( KERN_INFO "Could not register portb.\n");
-		goto err_rega;
+	while(done + sizeof(rec) <= size){
+		spin_lock_irqsave(&group->lock, flags);
+		found = kfifo_get(&group->records, &rec);
+		spin_unlock_irqrestore(&group->lock, flags);
+		if(!found)
+			break;
+		if(copy_to_user(buf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
 	}
-	else{
-		printk( KERN_INFO "Registered a portb char dev!\n");
+	return done;
+}
+
+static unsigned int groupchr_poll(struct file *file, poll_table *wait)
+{
+	struct lj_group *group = file->private_data;
+
+	poll_wait(file, &group->waitqueue, wait);
+	if(!lj_group_empty(group))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static long groupchr_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	struct lj_group *group = file->private_data;
+	struct lj_group_config *cfg;
+	long result;
+
+	switch(cmd){
+	case LJ_IOC_GROUP_SET:
+		cfg = memdup_user((void __user *)arg, sizeof(*cfg));
+		if(IS_ERR(cfg))
+			return PTR_ERR(cfg);
+		result = lj_group_set(group, cfg);
+		kfree(cfg);
+		return result;
 	}
+	return -ENOTTY;
+}
 
 
-	tmpname = kmalloc(sizeof(char)*LJ_NAMESIZE, GFP_KERNEL);
-	sprintf(tmpname, "lab%dportC",devid);
-	curstate->cchr_device.name = tmpname;
-	curstate->cchr_device.minor = minor + 2; /* c's minor is start
-						  * minor + 1 */
-	curstate->cchr_device.fops = &cchr_ops;
+/* stores a new tempurature reading in the cache portB reads from. */
+static int lj_temp_update(struct lj_state *state, int rawtemp)
+{
+	const struct lj_cal_entry *entry = &state->cal_temp;
+	u16 raw = rawtemp;
+	s32 mc;
+	int temp;
+	u64 now = ktime_get_ns();
+	struct lj_temp_record *rec;
+	unsigned long flags;
+
+	lj_cal_convert(&entry, &raw, &mc, 1);
+	/* whole degrees, truncated in kelvin like it always was */
+	temp = (mc + 273150) / 1000 - 273;
+
+	write_seqlock_irqsave(&state->temp_lock, flags);
+	state->curtemp = temp;
+	state->curtemp_ns = now;
+	rec = &state->b_hist[state->b_hist_head & (LJ_B_HIST - 1)];
+	rec->version = LJ_TEMP_RECORD_VERSION;
+	rec->size = sizeof(*rec);
+	rec->flags = 0;
+	rec->timestamp_ns = now;
+	rec->raw = rawtemp;
+	rec->millicelsius = mc;
+	state->b_hist_head++;
+	write_sequnlock_irqrestore(&state->temp_lock, flags);
+	lj_status_temp(state, temp, now);
+	return temp;
+}
 
+/* copies out the cached tempurature if the sampler is running and the
+ * reading is no older than the file's max age. Returns 0 if there is
+ * no usable cached value. */
+static int lj_temp_cached(struct lj_state *state, struct lj_bfile *bfile,
+			int *temp)
+{
+	unsigned int period = ACCESS_ONCE(state->b_sample_ms);
+	u64 max_age;
+	u64 stamp;
+	unsigned seq;
 
-	result = misc_register(&curstate->cchr_device);
-  
-	if(result){
-		printk( KERN_INFO "Could not register portc.\n");
-		goto err_regb;
-	}
-	else{
-		printk( KERN_INFO "Registered a portc char dev!\n");
-	}
+	if(!period)
+		return 0;
 
+	/* by default, allow readings up to two sampling periods old */
+	max_age = bfile->max_age_ms ? bfile->max_age_ms : 2*period;
+	max_age *= NSEC_PER_MSEC;
 
+	do{
+		seq = read_seqbegin(&state->temp_lock);
+		*temp = state->curtemp;
+		stamp = state->curtemp_ns;
+	}while(read_seqretry(&state->temp_lock, seq));
 
-	return 0;
-  
-err_regb:
-	misc_deregister(&curstate->bchr_device);
-	kfree(curstate->bchr_device.name);
-err_rega:
-	misc_deregister(&curstate->achr_device);
-	kfree(curstate->achr_device.name);
-err_intf:
-	remove_state_table(minor);
-err_hwlock:
-	kfree(curstate->hw_lock);
-err_alock: 
-	kfree(curstate->a_lock);
-err_free:
-	usb_set_intfdata(intf, NULL);
-	kfree(curstate);
-  
-error:
-	return -1;
+	return stamp && ktime_get_ns() - stamp <= max_age;
 }
 
-static  void lj_disconnect(struct usb_interface *intf)
+/* sets req up as a read of the internal tempurature sensor */
+static void lj_temp_req(struct lj_req *req, void (*done)(struct lj_req*),
+			void *context)
 {
-	struct lj_state *curstate;
-  
-	int minor;
-  
-	printk(KERN_INFO "ByeBye HW!!!\n");
-  
-	curstate = usb_get_intfdata(intf);
-  
-	curstate->curtemp = -INT_MAX;
-	wake_up_interruptible(&curstate->b_waitqueue);
+	req->flags = 0;
+	req->cmd[0] = 0x01;		/* Do an analog in */
+	req->cmd[1] = 30;		/* read the temp */
+	req->cmd[2] = 31;		/* compare it to gnd */
+	req->cmd_len = 3;
+	req->resp_len = 2;
+	req->done = done;
+	req->context = context;
+}
 
-	/* let the portC read syscall know there was an error */
-	curstate->airlock = air_error;
-	wake_up_interruptible(&curstate->c_waitqueue);
-	
-	del_timer_sync(&curstate->c_poll_timer);
-	minor = curstate->bchr_device.minor;
-	remove_state_table(minor);
-  
+/* ends the shared read, and hands its result to everyone waiting on
+ * this generation. */
+static void lj_b_finish(struct lj_state *state, int temp, int err)
+{
+	unsigned long flags;
 
-	misc_deregister(&curstate->achr_device);
-	kfree(curstate->achr_device.name);
-  
-	misc_deregister(&curstate->bchr_device);
-	kfree(curstate->bchr_device.name);
-  
-	misc_deregister(&curstate->cchr_device);
-	kfree(curstate->cchr_device.name);
+	spin_lock_irqsave(&state->b_lock, flags);
+	state->b_temp = temp;
+	state->b_err = err;
+	state->b_gen++;
+	state->b_busy = 0;
+	spin_unlock_irqrestore(&state->b_lock, flags);
 
-	kfree(curstate);
-	usb_set_intfdata(intf, NULL);
-    
+	wake_up(&state->b_waitqueue);
 }
-static int chr_open(struct inode *inode, struct file *file)
+
+static void b_req_done(struct lj_req *req)
 {
-	struct lj_state *lj_state = NULL;
-	int subminor;
+	struct lj_state *curstate = req->context;
 
-	subminor = iminor(inode);
-  
-  
-	lj_state = get_lj_state(subminor);
-	if (!lj_state){
-		printk(KERN_INFO "Could not access labjack state!\n");
-		goto error;
+	if(req->result){
+		printk(KERN_INFO "Error in portB read: %d.\n", req->result);
+		lj_b_finish(curstate, 0, req->result);
+		return;
 	}
-  
-	file->private_data = lj_state;
-	printk(KERN_INFO "someone opened me!\n");
-	return 0;
-error:
-	return -1;
+	lj_b_finish(curstate, lj_temp_update(curstate,
+				req->resp[0] + (req->resp[1] << 8)), 0);
 }
 
-
-static void b_urb_in_cbk(struct urb *urb)
+/* starts the shared tempurature read in class prio, unless one is
+ * already in flight, in which case the caller rides along with it.
+ * Returns the generation that will carry the caller's reading. Safe to
+ * call from atomic context. */
+static unsigned long lj_b_start(struct lj_state *state, int prio)
 {
-	u8 *rcv_packet;
-	struct lj_state *curstate;
-	int rawtemp;
-	const int KFROMBIN = 13;
-	const int KDIV = 1000;
-
-	curstate = (struct lj_state*)urb->context;
-	rcv_packet = urb->transfer_buffer;
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in portb IN cbk.\n");
-		/* for some reason we got shutdown. abort. */
-		goto error;
+	unsigned long flags;
+	unsigned long gen;
+	int result;
+
+	spin_lock_irqsave(&state->b_lock, flags);
+	gen = state->b_gen + 1;
+	if(state->b_busy){
+		spin_unlock_irqrestore(&state->b_lock, flags);
+		return gen;
 	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in portb urb in cbk: %d.\n", 
-			urb->status);
-		goto error;
+	state->b_busy = 1;
+	spin_unlock_irqrestore(&state->b_lock, flags);
+
+	lj_temp_req(&state->b_req, b_req_done, state);
+	state->b_req.prio = prio;
+	result = lj_req_submit(state, &state->b_req);
+	if(result)
+		lj_b_finish(state, 0, result);
+	return gen;
+}
+
+/* copies out the result of generation gen, or a later one. Returns 0
+ * if it hasn't finished yet. */
+static int lj_b_result(struct lj_state *state, unsigned long gen,
+		int *temp, int *err)
+{
+	unsigned long flags;
+	int done;
+
+	spin_lock_irqsave(&state->b_lock, flags);
+	done = (long)(state->b_gen - gen) >= 0;
+	if(done){
+		*temp = state->b_temp;
+		*err = state->b_err;
 	}
-	
-	if(was_err(rcv_packet, urb->actual_length)){
-		printk(KERN_INFO "bad checksum in portb in cbk!\n");
-		goto error;
+	spin_unlock_irqrestore(&state->b_lock, flags);
+	return done;
+}
+
+/* makes sure this file is waiting on a read, for poll and nonblocking
+ * reads. */
+static void lj_b_kick(struct lj_bfile *bfile)
+{
+	spin_lock(&bfile->lock);
+	if(!bfile->pending){
+		bfile->want_gen = lj_b_start(bfile->state, LJ_PRIO_BULK);
+		bfile->pending = 1;
 	}
-	else if (rcv_packet[6]){
-		printk(KERN_INFO "error in portb in cbk: %d", rcv_packet[6]);
-		goto error;
+	spin_unlock(&bfile->lock);
+}
+
+/* takes the reading this file was waiting on, if it has arrived.
+ * Returns 1 if it had. */
+static int lj_b_take(struct lj_bfile *bfile, int *temp, int *err)
+{
+	int ready = 0;
+
+	spin_lock(&bfile->lock);
+	if(bfile->pending &&
+		lj_b_result(bfile->state, bfile->want_gen, temp, err)){
+		bfile->pending = 0;
+		ready = 1;
 	}
+	spin_unlock(&bfile->lock);
+	return ready;
+}
 
-	/* convert the temperature and store in the curtemp field. */
-	rawtemp = rcv_packet[9] + (rcv_packet[10] << 8);
-	curstate->curtemp = (rawtemp * KFROMBIN) / KDIV;
-	curstate->curtemp -= 273;
-	spin_unlock(curstate->hw_lock);
-	wake_up_interruptible(&curstate->b_waitqueue);
-	kfree(rcv_packet);
-	return;
-	
-error: 
-	kfree(rcv_packet);
-	curstate->curtemp = -INT_MAX;
-	wake_up_interruptible(&curstate->b_waitqueue);
-	spin_unlock(curstate->hw_lock);
-	return;
+/* copies up to max readings this file hasn't seen out of the history
+ * ring, and moves past them. Returns how many there were. */
+static int lj_b_hist_copy(struct lj_bfile *bfile,
+			struct lj_temp_record *recs, int max)
+{
+	struct lj_state *state = bfile->state;
+	unsigned seq;
+	u64 head, pos;
+	int lost;
+	int count;
+	int i;
+
+	spin_lock(&bfile->lock);
+	do{
+		seq = read_seqbegin(&state->temp_lock);
+		head = state->b_hist_head;
+		pos = bfile->hist_pos;
+		lost = head - pos > LJ_B_HIST;
+		if(lost)
+			pos = head - LJ_B_HIST;
+		count = min_t(u64, head - pos, max);
+		for(i = 0; i < count; i++)
+			recs[i] = state->b_hist[(pos + i) & (LJ_B_HIST - 1)];
+	}while(read_seqretry(&state->temp_lock, seq));
+	bfile->hist_pos = pos + count;
+	spin_unlock(&bfile->lock);
+
+	if(count && lost)
+		recs[0].flags |= LJ_TEMP_OVERRUN;
+	return count;
 }
 
-static void b_urb_out_cbk(struct urb *urb)
+static int lj_b_hist_unread(struct lj_bfile *bfile)
 {
-	u8 *rcv_packet = NULL;
-	struct lj_state *curstate;
-	const int RCVSIZE = 12;
-	int result;
-	u8 *snd_packet;
+	struct lj_state *state = bfile->state;
+	unsigned seq;
+	int unread;
+
+	do{
+		seq = read_seqbegin(&state->temp_lock);
+		unread = state->b_hist_head != ACCESS_ONCE(bfile->hist_pos);
+	}while(read_seqretry(&state->temp_lock, seq));
+	return unread;
+}
 
-	curstate = (struct lj_state*)urb->context;
-	snd_packet = urb->transfer_buffer;	
-	if(urb->status && 
-		(urb->status == -ENOENT ||
-			urb->status == -ECONNRESET ||
-			urb->status == -ESHUTDOWN)){			
-		printk(KERN_INFO "unexpected urb unlink in portb callback.\n");
-		/* for some reason we got shutdown. abort. */
-		goto error;
+/* bchr_read for LJ_B_FORMAT_RECORD. Returns every reading this file
+ * hasn't seen that fits, or waits for a new one if there are none. */
+static ssize_t lj_b_read_records(struct file *file, char __user *buf,
+				size_t size)
+{
+	struct lj_bfile *bfile = file->private_data;
+	struct lj_state *state = bfile->state;
+	struct lj_temp_record *recs;
+	int max = min_t(size_t, size / sizeof(*recs), LJ_B_HIST);
+	unsigned long gen;
+	ssize_t result;
+	int count;
+	int temp;
+	int err;
+
+	if(!max)
+		return -EINVAL;
+	recs = kmalloc(max * sizeof(*recs), GFP_KERNEL);
+	if(!recs)
+		return -ENOMEM;
+
+	while(!(count = lj_b_hist_copy(bfile, recs, max))){
+		/* a finished async read has already put its reading in
+		 * the ring, or failed */
+		if(lj_b_take(bfile, &temp, &err) && err){
+			result = -EIO;
+			goto out;
+		}
+		if(file->f_flags & O_NONBLOCK){
+			lj_b_kick(bfile);
+			result = -EAGAIN;
+			goto out;
+		}
+		gen = lj_b_start(state, LJ_PRIO_BULK);
+		if(wait_event_interruptible(state->b_waitqueue,
+				lj_b_result(state, gen, &temp, &err))){
+			result = -ERESTARTSYS;
+			goto out;
+		}
+		if(err){
+			result = -EIO;
+			goto out;
+		}
 	}
-	else if (urb->status){
-		printk(KERN_INFO "Error in portb urb out cbk: %d.\n", 
-			urb->status);
-		goto error;
+
+	result = count * sizeof(*recs);
+	if(copy_to_user(buf, recs, result))
+		result = -EFAULT;
+out:
+	kfree(recs);
+	return result;
+}
+
+/* works out when periodic work runs next. It steps from when it was
+ * due rather than from now, so a late tick doesn't push everything
+ * after it back, but work that fell a whole period behind starts over
+ * from now. Returns how many periods were skipped. */
+static u64 lj_tick_step(u64 *next, u64 period, u64 now)
+{
+	u64 missed;
+
+	*next += period;
+	if(*next > now)
+		return 0;
+	missed = div64_u64(now - *next, period) + 1;
+	*next += missed * period;
+	return missed;
+}
+
+/* runs every labjack's periodic work that is due: portC polls, portB
+ * samples and portA toggles. One timer does it for all of them, and
+ * sleeps until the next work is due. */
+static enum hrtimer_restart lj_tick_cbk(struct hrtimer *timer)
+{
+	struct lj_state *state;
+	unsigned long flags;
+	u64 now = ktime_get_ns();
+	u64 next = U64_MAX;
+	unsigned int ms;
+	u32 us;
+
+	spin_lock_irqsave(&lj_tick_lock, flags);
+	list_for_each_entry(state, &lj_tick_list, tick_node){
+		if(state->c_next_ns && state->c_next_ns <= now){
+			us = lj_c_poll(state);
+			state->c_missed += lj_tick_step(&state->c_next_ns,
+					(u64)us * NSEC_PER_USEC, now);
+		}
+		if(state->b_next_ns && state->b_next_ns <= now){
+			/* if a read is already in flight, it refreshes the
+			 * cache */
+			lj_b_start(state, LJ_PRIO_POLL);
+			ms = ACCESS_ONCE(state->b_sample_ms);
+			if(ms)
+				lj_tick_step(&state->b_next_ns,
+					(u64)ms * NSEC_PER_MSEC, now);
+			else
+				state->b_next_ns = 0;
+		}
+		if(state->a_next_ns && state->a_next_ns <= now){
+			lj_a_toggle(state);
+			lj_tick_step(&state->a_next_ns,
+				(u64)state->a_freq * NSEC_PER_SEC, now);
+		}
+
+		if(state->c_next_ns)
+			next = min(next, state->c_next_ns);
+		if(state->b_next_ns)
+			next = min(next, state->b_next_ns);
+		if(state->a_next_ns)
+			next = min(next, state->a_next_ns);
 	}
+	if(next != U64_MAX)
+		lj_tick_arm(next);
+	spin_unlock_irqrestore(&lj_tick_lock, flags);
+	return HRTIMER_NORESTART;
+}
 
-	rcv_packet = kmalloc(sizeof(u8)*RCVSIZE, GFP_ATOMIC);
+static int bchr_open(struct inode *inode, struct file *file)
+{
+	struct lj_bfile *bfile;
 
-	if(!rcv_packet)
-	{
-		printk(KERN_INFO "Could not allocate memory for rcv!\n");
-		goto error;
+	if(chr_open(inode, file)){
+		return -ENODEV;
 	}
-	
-	usb_fill_bulk_urb(urb, curstate->usb_device,
-			usb_rcvbulkpipe(curstate->usb_device, 2),
-			rcv_packet, RCVSIZE, b_urb_in_cbk, curstate);
 
-	result = usb_submit_urb(urb, GFP_ATOMIC);
-	if(result)
-	{
-		printk("Could not submit portB IN urb!\n");
-		goto err_rcv;
+	bfile = kzalloc(sizeof(*bfile), GFP_KERNEL);
+	if(!bfile){
+		lj_state_put(file->private_data);
+		return -ENOMEM;
 	}
+	bfile->state = file->private_data;
+	spin_lock_init(&bfile->lock);
+	file->private_data = bfile;
+	return 0;
+}
 
-	kfree(snd_packet);
-	return;
-	
-err_rcv:
-	kfree(rcv_packet);
-error: 
-	kfree(snd_packet);
-	curstate->curtemp = -INT_MAX;
-	wake_up_interruptible(&curstate->b_waitqueue);
-	spin_unlock(curstate->hw_lock);
-	return;
+static int bchr_release(struct inode *inode, struct file *file)
+{
+	struct lj_bfile *bfile = file->private_data;
+
+	/* a read this file was waiting on belongs to the state, so it
+	 * can finish without us */
+	lj_state_put(bfile->state);
+	kfree(bfile);
+	return 0;
 }
 
 static ssize_t bchr_read(struct file *file, char __user *buf, 
 			size_t size, loff_t *off)
 {
-	const int SNDSIZE = 10;
-
-	struct lj_state *lj_state = NULL;
-
-	
-	u8 *snd_packet = NULL;
-	struct urb *urb;
+	struct lj_bfile *bfile = file->private_data;
+	struct lj_state *lj_state = bfile->state;
+	unsigned long gen;
+	int temp;
+	int err;
 	int result;
 
-	printk(KERN_INFO "Someone tried to read on portb!\n");
-	
+	if(bfile->format == LJ_B_FORMAT_RECORD)
+		return lj_b_read_records(file, buf, size);
+
 	/* if they don't give us enough space, we have to abort*/
-	if(size < sizeof (int)){
-		return -EINVAL;
-	}
-  
-	snd_packet = kmalloc(sizeof(u8)* SNDSIZE, GFP_KERNEL);
-	
-	if(!snd_packet)
-	{
-		printk(KERN_INFO "Could not allocate space for snd_packet!\n");
-		goto error;
-	}
-	/* 8bit checksum */
-	snd_packet[1] = 0xf8;
-	snd_packet[2] = 0x2; 		/* number of words is .5 + 1.5 */
-	snd_packet[3] = 0x00;
-	/* 16bit checksum */
-	snd_packet[6] = 0x00;		/* echo can be whatever we want */
-	snd_packet[7] = 0x01;		/* Do an analog in */
-	snd_packet[8] = 30;		/* read the temp */
-	snd_packet[9] = 31;		/* compare it to gnd */
+	if(size < sizeof (int)){
+		return -EINVAL;
+	}
 
-	fix_checksum16(snd_packet, SNDSIZE);
+	if(lj_temp_cached(lj_state, bfile, &temp))
+		goto out;
 
-	lj_state = file->private_data;
-  
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	urb->transfer_flags = 0;
+	/* a read started by poll or an earlier nonblocking read */
+	if(lj_b_take(bfile, &temp, &err)){
+		if(err)
+			return -EIO;
+		goto out;
+	}
 
-	usb_fill_bulk_urb(urb, lj_state->usb_device, 
-			usb_sndbulkpipe(lj_state->usb_device, 1), 
-			snd_packet, SNDSIZE, b_urb_out_cbk, lj_state);
-	/* in here, this function has unique access to the hardware. */
-	spin_lock(lj_state->hw_lock);
+	if(file->f_flags & O_NONBLOCK){
+		lj_b_kick(bfile);
+		return -EAGAIN;
+	}
 
-	result = usb_submit_urb(urb, GFP_KERNEL);
-	
+	/* join the read in flight, if there is one. The watchdog bounds
+	 * the wait. */
+	gen = lj_b_start(lj_state, LJ_PRIO_BULK);
+	result = wait_event_interruptible(lj_state->b_waitqueue,
+			lj_b_result(lj_state, gen, &temp, &err));
 	if(result)
-	{
-		WARN_ON(result);
-		goto err_spin;
+		return result;
+	if(err){
+		printk(KERN_INFO "error in bchr_read: %d\n", err);
+		return -EIO;
 	}
+out:
+	if(copy_to_user(buf, &temp, sizeof(int)))
+		return -EFAULT;
+  
+	return sizeof(int);
+}
 
-	lj_state->curtemp = INT_MAX;
-	
-	if(wait_event_interruptible(lj_state->b_waitqueue, 
-					lj_state->curtemp != INT_MAX)){
-		printk(KERN_INFO "error in bchr_read: wait interrupted!\n");
-		goto err_spin;
+/* portB is readable when there is a fresh enough cached reading, or
+ * this file's async read has finished. Otherwise polling starts one. */
+static unsigned int bchr_poll(struct file *file, poll_table *wait)
+{
+	struct lj_bfile *bfile = file->private_data;
+	struct lj_state *curstate = bfile->state;
+	unsigned int mask = 0;
+	int temp;
+	int err;
+
+	poll_wait(file, &curstate->b_waitqueue, wait);
+
+	if(bfile->format == LJ_B_FORMAT_RECORD){
+		if(lj_b_hist_unread(bfile))
+			return POLLIN | POLLRDNORM;
+		/* a finished read's reading is in the ring already, so
+		 * only its error matters */
+		if(lj_b_take(bfile, &temp, &err) && err)
+			return POLLERR;
+		lj_b_kick(bfile);
+		return curstate->req_dead ? POLLERR : 0;
 	}
 
+	if(lj_temp_cached(curstate, bfile, &temp))
+		return POLLIN | POLLRDNORM;
 
-	if(lj_state->curtemp == -INT_MAX){
-		goto error;
+	lj_b_kick(bfile);
+	if(lj_b_result(curstate, ACCESS_ONCE(bfile->want_gen), &temp, &err)){
+		mask |= POLLIN | POLLRDNORM;
+		if(err)
+			mask |= POLLERR;
 	}
-  
-	copy_to_user(buf, &lj_state->curtemp, sizeof(int));
-  
-	return sizeof(int);
+	else if(curstate->req_dead){
+		mask |= POLLERR;
+	}
+	return mask;
+}
 
-	
-err_spin:
-	spin_unlock(lj_state->hw_lock);	
-	kfree(snd_packet);
-error:
-	return -EINVAL;
+static long bchr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lj_bfile *bfile = file->private_data;
+	struct lj_state *curstate = bfile->state;
+	unsigned seq;
+	u64 head;
+	u32 fmt;
+	u32 ms;
+	int result;
+
+	switch(cmd){
+	case LJ_IOC_B_SAMPLE_PERIOD:
+		if(get_user(ms, (u32 __user *)arg))
+			return -EFAULT;
+		if(ms && ms < LJ_PORTB_MIN_PERIOD)
+			return -EINVAL;
+		mutex_lock(&curstate->b_sample_mutex);
+		if(curstate->req_dead){
+			mutex_unlock(&curstate->b_sample_mutex);
+			return -ENODEV;
+		}
+		curstate->b_sample_ms = ms;
+		result = lj_tick_set(curstate, &curstate->b_next_ns,
+				ms ? ktime_get_ns() : 0);
+		mutex_unlock(&curstate->b_sample_mutex);
+		return result;
+
+	case LJ_IOC_B_MAX_AGE:
+		if(get_user(ms, (u32 __user *)arg))
+			return -EFAULT;
+		bfile->max_age_ms = ms;
+		return 0;
+
+	case LJ_IOC_B_FORMAT:
+		if(get_user(fmt, (u32 __user *)arg))
+			return -EFAULT;
+		if(fmt != LJ_B_FORMAT_INT && fmt != LJ_B_FORMAT_RECORD)
+			return -EINVAL;
+		/* start from the oldest reading the ring still holds */
+		spin_lock(&bfile->lock);
+		do{
+			seq = read_seqbegin(&curstate->temp_lock);
+			head = curstate->b_hist_head;
+		}while(read_seqretry(&curstate->temp_lock, seq));
+		bfile->hist_pos = head > LJ_B_HIST ? head - LJ_B_HIST : 0;
+		bfile->format = fmt;
+		spin_unlock(&bfile->lock);
+		return 0;
+	}
+	return lj_common_ioctl(curstate, cmd, arg);
 }
 
 
@@ -1062,21 +5237,44 @@ static ssize_t achr_read(struct file *file, char __user *buf,
 			size_t size, loff_t *off)
 {
 	int curtime;
+	int hw;
+	u32 half;
+	u64 elapsed;
+	u64 next, now, start;
+	unsigned long flags;
 	struct lj_state *curstate = file->private_data;
-	printk(KERN_INFO "Someone tried to read on portA!\n");
 	
 	
 	if (size < sizeof(u8)){
 		return -EINVAL;
 	}
 	
-	spin_lock(curstate->a_lock);
-	curtime = curstate->a_poll_timer.expires;
-	
-	curtime = (curstate->a_freq*HZ - (curtime - jiffies))/HZ;
-	spin_unlock(curstate->a_lock);
+	/* the ioctls can stop or restart Timer0 under us */
+	mutex_lock(&curstate->a_mutex);
+	hw = curstate->a_hw;
+	half = curstate->a_period_us / 2;
+	start = curstate->a_hw_start;
+	mutex_unlock(&curstate->a_mutex);
+
+	if(hw){
+		/* Timer0 has toggled every half period since it started */
+		elapsed = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+		curtime = half ? do_div(elapsed, half) / USEC_PER_SEC : 0;
+	}
+	else{
+		/* seconds since the last toggle from the tick */
+		spin_lock_irqsave(&lj_tick_lock, flags);
+		next = curstate->a_next_ns;
+		elapsed = (u64)curstate->a_freq * NSEC_PER_SEC;
+		spin_unlock_irqrestore(&lj_tick_lock, flags);
+		now = ktime_get_ns();
+		if(next > now)
+			elapsed -= min(elapsed, next - now);
+		curtime = next ? div_u64(elapsed, NSEC_PER_SEC) : 0;
+	}
 
-	copy_to_user(buf, &curtime, sizeof(u8));
+	if(copy_to_user(buf, &curtime, sizeof(u8)))
+		return -EFAULT;
 	
 	return sizeof(u8);
 	
@@ -1085,56 +5283,49 @@ static ssize_t achr_read(struct file *file, char __user *buf,
 static int achr_open(struct inode *inode, struct file *file)
 {
 	struct lj_state *curstate;
-	printk(KERN_INFO "Someone tried to open portA!\n");
+	int result;
 	if(chr_open(inode, file)){
 		return -1;
 	}
 	
 	curstate = (struct lj_state*)file->private_data;
 	
-	spin_lock(curstate->a_lock);
+	mutex_lock(&curstate->a_mutex);
 
-	/* if a_freq is nonzero, that means that someone else already
+	/* if a period is set, that means that someone else already
 	 * has the timer running :/ */
-	if(curstate->a_freq)
+	if(curstate->a_period_us)
 	{
-		spin_unlock(curstate->a_lock);
+		mutex_unlock(&curstate->a_mutex);
 		printk(KERN_INFO "portA timer already running :/\n");
 		return 0;
 	}
-	curstate->a_freq = LJ_PORTA_FREQ; 	/* start running at 60Hz */
 	curstate->fio4_state = 1;
-	
-	curstate->a_poll_timer.expires = jiffies + curstate->a_freq*HZ;
-	add_timer(&curstate->a_poll_timer);
-
-
-	spin_unlock(curstate->a_lock);
-
 	set_fio4_lvl(curstate, 1);
+
+	/* start toggling every LJ_PORTA_FREQ seconds */
+	result = lj_a_set_period(curstate, 2 * LJ_PORTA_FREQ * USEC_PER_SEC);
+	mutex_unlock(&curstate->a_mutex);
+	if(result)
+		lj_state_put(curstate);
 	
-	return 0;
+	return result;
 
 }
 
 static int achr_release(struct inode *inode, struct file *file)
 {
 	struct lj_state *curstate;
-	printk(KERN_INFO "Someone tried to release portA!\n");
 
 	curstate = (struct lj_state*)file->private_data;
-	spin_lock(curstate->a_lock);
-	/* if there is an in-flight timer, kill it. */
-	if(curstate->a_freq){
-		printk(KERN_INFO "Killing in-flight timer for portA\n");
-		del_timer_sync(&curstate->a_poll_timer);
-		curstate->a_freq = 0;
-	}
-
+	mutex_lock(&curstate->a_mutex);
+	/* stop the timer, whichever one is running. */
+	lj_a_set_period(curstate, 0);
+	mutex_unlock(&curstate->a_mutex);
 
-	spin_unlock(curstate->a_lock);
 	curstate->fio4_state = 0;
 	set_fio4_lvl(curstate, 0);
+	lj_state_put(curstate);
 	return 0;
 
 }
@@ -1143,22 +5334,74 @@ static ssize_t achr_write(struct file * file, const char __user *buf,
 			size_t len, loff_t *offset)
 {
 	u8 freq;
+	int result;
 	struct lj_state *curstate = (struct lj_state*)file->private_data;
-	printk(KERN_INFO "Someone tried to write on portA!\n");
 
 	if(len < sizeof(u8)){
 		return -EINVAL;
 	}
 
-	copy_from_user(&freq, buf, sizeof(u8));
-	spin_lock(curstate->a_lock);
-	curstate->a_freq = freq;
-	spin_unlock(curstate->a_lock);
-	printk(KERN_INFO "portA freq set to: %d\n", freq);
+	if(copy_from_user(&freq, buf, sizeof(u8)))
+		return -EFAULT;
+	/* freq is the time between toggles, so the period is twice it */
+	mutex_lock(&curstate->a_mutex);
+	result = lj_a_set_period(curstate, 2 * freq * USEC_PER_SEC);
+	mutex_unlock(&curstate->a_mutex);
+	if(result)
+		return result;
 	return sizeof(u8);
 
 }
 
+static long achr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lj_state *curstate = file->private_data;
+	u32 us;
+	int result;
+
+	switch(cmd){
+	case LJ_IOC_A_SET_PERIOD:
+		if(get_user(us, (u32 __user *)arg))
+			return -EFAULT;
+		mutex_lock(&curstate->a_mutex);
+		result = lj_a_set_period(curstate, us);
+		mutex_unlock(&curstate->a_mutex);
+		return result;
+
+	case LJ_IOC_A_GET_PERIOD:
+		return put_user(curstate->a_period_us, (u32 __user *)arg);
+	}
+	return lj_common_ioctl(curstate, cmd, arg);
+}
+
+
+static int cchr_open(struct inode *inode, struct file *file)
+{
+	struct lj_state *curstate;
+
+	if(chr_open(inode, file))
+		return -ENODEV;
+
+	curstate = file->private_data;
+	mutex_lock(&curstate->c_mutex);
+	curstate->c_users++;
+	mutex_unlock(&curstate->c_mutex);
+	return 0;
+}
+
+/* the last portC file to close stops the polling */
+static int cchr_release(struct inode *inode, struct file *file)
+{
+	struct lj_state *curstate = file->private_data;
+
+	mutex_lock(&curstate->c_mutex);
+	if(!--curstate->c_users && curstate->c_active){
+		curstate->c_active = 0;
+		lj_tick_set(curstate, &curstate->c_next_ns, 0);
+	}
+	mutex_unlock(&curstate->c_mutex);
+	return chr_release(inode, file);
+}
 
 static ssize_t cchr_read(struct file *file, char __user *buf, 
 			size_t size, loff_t *off)
@@ -1168,10 +5411,13 @@ static ssize_t cchr_read(struct file *file, char __user *buf,
 	char *mesg = "Airlock open!";
 	const int MESG_LEN = 14;
 
-	printk(KERN_INFO "Someone tried to read on portC!\n");
 	
 	cpysize = (size < MESG_LEN) ? size : MESG_LEN;
 	curstate = (struct lj_state*)file->private_data;
+	if(lj_c_demand(curstate))
+		return -EIO;
+	if(curstate->airlock == air_closed && (file->f_flags & O_NONBLOCK))
+		return -EAGAIN;
 	if(wait_event_interruptible(curstate->c_waitqueue, 
 					curstate->airlock != air_closed)){
 		printk(KERN_INFO "error in cchr wait event!\n");
@@ -1179,14 +5425,585 @@ static ssize_t cchr_read(struct file *file, char __user *buf,
 	}
 	if(curstate->airlock == air_error)
 	{
-		return -ERESTARTSYS;
+		return -EIO;
 	}
-	printk(KERN_INFO "cchar_read woke up!\n");
-	copy_to_user(buf, mesg, cpysize);
+	if(copy_to_user(buf, mesg, cpysize))
+		return -EFAULT;
 
 	return cpysize;
 }
 
+/* portC is readable whenever a read wouldn't block */
+static unsigned int cchr_poll(struct file *file, poll_table *wait)
+{
+	struct lj_state *curstate = file->private_data;
+	unsigned int mask = 0;
+
+	lj_c_demand(curstate);
+	poll_wait(file, &curstate->c_waitqueue, wait);
+
+	switch(curstate->airlock){
+	case air_open:
+		mask |= POLLIN | POLLRDNORM;
+		break;
+	case air_error:
+		mask |= POLLERR;
+		break;
+	case air_closed:
+		break;
+	}
+	if(!kfifo_is_empty(&curstate->events))
+		mask |= POLLPRI;
+	return mask;
+}
+
+static int lj_event_get(struct lj_state *state, struct lj_event *event)
+{
+	unsigned long flags;
+	int found;
+
+	spin_lock_irqsave(&state->rules_lock, flags);
+	found = kfifo_get(&state->events, event);
+	spin_unlock_irqrestore(&state->rules_lock, flags);
+	return found;
+}
+
+static long cchr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lj_state *curstate = file->private_data;
+	struct lj_rule_state *rs;
+	struct lj_rule rule;
+	struct lj_event event;
+	unsigned long flags;
+	int result = 0;
+	u32 us;
+
+	switch(cmd){
+	case LJ_IOC_C_SET_RULE:
+		if(copy_from_user(&rule, (void __user *)arg, sizeof(rule)))
+			return -EFAULT;
+		if(rule.index >= LJ_MAX_RULES || rule.channel > 31 ||
+			rule.low > rule.high)
+			return -EINVAL;
+
+		rs = &curstate->rules[rule.index];
+		spin_lock_irqsave(&curstate->rules_lock, flags);
+		rs->cfg = rule;
+		rs->level = -1;
+		rs->count = 0;
+		rs->have_last = 0;
+		spin_unlock_irqrestore(&curstate->rules_lock, flags);
+		return 0;
+
+	case LJ_IOC_C_GET_RULE:
+		if(copy_from_user(&rule, (void __user *)arg, sizeof(rule)))
+			return -EFAULT;
+		if(rule.index >= LJ_MAX_RULES)
+			return -EINVAL;
+
+		spin_lock_irqsave(&curstate->rules_lock, flags);
+		rule = curstate->rules[rule.index].cfg;
+		spin_unlock_irqrestore(&curstate->rules_lock, flags);
+
+		if(copy_to_user((void __user *)arg, &rule, sizeof(rule)))
+			return -EFAULT;
+		return 0;
+
+	case LJ_IOC_C_SET_PERIOD:
+		if(get_user(us, (u32 __user *)arg))
+			return -EFAULT;
+		if(us < LJ_PORTC_MIN_PERIOD)
+			return -EINVAL;
+		/* if polling, poll next at the fast period, so a long
+		 * old period doesn't delay the new one */
+		if(curstate->req_dead)
+			return -ENODEV;
+		mutex_lock(&curstate->c_mutex);
+		curstate->c_period_us = us;
+		if(curstate->c_active){
+			curstate->c_cur_us = lj_c_fast(curstate);
+			result = lj_tick_set(curstate, &curstate->c_next_ns,
+				ktime_get_ns() +
+				(u64)curstate->c_cur_us * NSEC_PER_USEC);
+		}
+		mutex_unlock(&curstate->c_mutex);
+		return result;
+
+	case LJ_IOC_C_GET_PERIOD:
+		return put_user(curstate->c_period_us, (u32 __user *)arg);
+
+	case LJ_IOC_C_GET_EVENT:
+		lj_c_demand(curstate);
+		while(!lj_event_get(curstate, &event)){
+			if(curstate->airlock == air_error)
+				return -EIO;
+			if(file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if(wait_event_interruptible(curstate->c_waitqueue,
+					!kfifo_is_empty(&curstate->events) ||
+					curstate->airlock == air_error))
+				return -ERESTARTSYS;
+		}
+		if(copy_to_user((void __user *)arg, &event, sizeof(event)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(curstate, cmd, arg);
+}
+
+
+/* sends a whole command and waits for its response, in turn with the
+ * Feedback packets. Must be called from process context. Returns the
+ * number of bytes received. */
+static int lj_cmd_sync(struct lj_state *state, const u8 *snd, int sndsize,
+		u8 *rcv, int rcvsize)
+{
+	struct lj_req req;
+	int result;
+
+	if(sndsize > LJ_MAX_PACKET || rcvsize > LJ_MAX_PACKET)
+		return -EINVAL;
+
+	req.flags = LJ_REQ_RAW;
+	memcpy(req.cmd, snd, sndsize);
+	req.cmd_len = sndsize;
+	req.resp_len = rcvsize;
+
+	result = lj_req_sync(state, &req, LJ_PRIO_BULK);
+	if(result > 0)
+		memcpy(rcv, req.resp, result);
+	return result;
+}
+
+/* loads the stream config used when nobody configured the stream
+ * port: AIN10 against ground, 1000 scans per second. */
+static void lj_stream_default_cfg(struct lj_stream_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->num_channels = 1;
+	cfg->samples_per_packet = 25;
+	cfg->scan_config = 0;		/* 4MHz clock */
+	cfg->scan_interval = 4000;	/* 4MHz / 4000 = 1kHz */
+	cfg->pchannel[0] = 10;
+	cfg->nchannel[0] = 31;
+}
+
+/* counts a failed stream urb. Returns nonzero, and wakes the readers
+ * to stop the stream, once too many have failed in a row. A stalled
+ * or unplugged endpoint fails every time, so resubmitting forever
+ * would just spin. */
+static int lj_stream_error(struct lj_state *state)
+{
+	int failed;
+
+	spin_lock(&state->stream_lock);
+	state->stream_stats.urb_errors++;
+	if(++state->stream_fails >= LJ_STREAM_MAX_ERRORS &&
+		!state->stream_failed){
+		printk(KERN_INFO "stream urbs keep failing, stopping\n");
+		state->stream_failed = 1;
+	}
+	failed = state->stream_failed;
+	spin_unlock(&state->stream_lock);
+
+	if(failed)
+		wake_up_interruptible(&state->s_waitqueue);
+	return failed;
+}
+
+static void s_urb_in_cbk(struct urb *urb)
+{
+	struct lj_state *curstate = urb->context;
+	u8 *rcv_packet = urb->transfer_buffer;
+	u16 *samples;
+	int nsamples;
+	int copied;
+	int i;
+	int result;
+
+	if(urb->status == -ENOENT ||
+		urb->status == -ECONNRESET ||
+		urb->status == -ESHUTDOWN){
+		/* the stream is being stopped. don't resubmit. */
+		return;
+	}
+	else if (urb->status){
+		goto error;
+	}
+	this_cpu_add(curstate->stats->bytes_in, urb->actual_length);
+
+	if(urb->actual_length < 14 ||
+		rcv_packet[1] != 0xf9 ||
+		rcv_packet[3] != 0xc0){
+		goto error;
+	}
+
+	nsamples = rcv_packet[2] - 4;
+	if(nsamples < 0 || urb->actual_length < 14 + 2*nsamples){
+		goto error;
+	}
+
+	/* decode the samples in place, then push them into the ring */
+	samples = (u16*)&rcv_packet[12];
+	for(i = 0; i < nsamples; i++)
+		le16_to_cpus(&samples[i]);
+
+	spin_lock(&curstate->stream_lock);
+	curstate->stream_fails = 0;
+	curstate->stream_stats.packets++;
+	if(rcv_packet[11])
+		curstate->stream_stats.device_errors++;
+
+	/* the packet counter wraps at 256 */
+	if(rcv_packet[10] != curstate->stream_next_pkt){
+		curstate->stream_stats.lost_packets +=
+			(u8)(rcv_packet[10] - curstate->stream_next_pkt);
+	}
+	curstate->stream_next_pkt = rcv_packet[10] + 1;
+
+	copied = kfifo_in(&curstate->stream_fifo, samples, nsamples);
+	curstate->stream_stats.overflow_samples += nsamples - copied;
+	spin_unlock(&curstate->stream_lock);
+
+	wake_up_interruptible(&curstate->s_waitqueue);
+
+resubmit:
+	if(!curstate->stream_running || ACCESS_ONCE(curstate->stream_failed))
+		return;
+	result = usb_submit_urb(urb, GFP_ATOMIC);
+	if(!result)
+		return;
+	printk(KERN_INFO "Could not resubmit stream urb: %d\n", result);
+	lj_stream_error(curstate);
+	return;
+
+error:
+	if(!lj_stream_error(curstate))
+		goto resubmit;
+}
+
+/* kills and frees the stream urbs. Called with stream_mutex held. */
+static void lj_stream_free_urbs(struct lj_state *state)
+{
+	int i;
+	struct urb *urb;
+
+	for(i = 0; i < LJ_STREAM_URBS; i++){
+		urb = state->stream_urbs[i];
+		if(!urb)
+			continue;
+		usb_kill_urb(urb);
+		usb_free_coherent(state->usb_device, LJ_STREAM_PKTSIZE,
+				urb->transfer_buffer, urb->transfer_dma);
+		usb_free_urb(urb);
+		state->stream_urbs[i] = NULL;
+	}
+}
+
+static int lj_stream_alloc_urbs(struct lj_state *state)
+{
+	int i;
+	struct urb *urb;
+	u8 *buf;
+
+	for(i = 0; i < LJ_STREAM_URBS; i++){
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if(!urb)
+			goto error;
+		buf = usb_alloc_coherent(state->usb_device, LJ_STREAM_PKTSIZE,
+					GFP_KERNEL, &urb->transfer_dma);
+		if(!buf){
+			usb_free_urb(urb);
+			goto error;
+		}
+		usb_fill_bulk_urb(urb, state->usb_device,
+				usb_rcvbulkpipe(state->usb_device, 3),
+				buf, LJ_STREAM_PKTSIZE, s_urb_in_cbk, state);
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		state->stream_urbs[i] = urb;
+	}
+	return 0;
+
+error:
+	lj_stream_free_urbs(state);
+	return -ENOMEM;
+}
+
+/* StreamStart and StreamStop share the same 2 byte command and 4 byte
+ * response format. */
+static int lj_stream_cmd(struct lj_state *state, u8 cmd)
+{
+	u8 snd_packet[2];
+	u8 rcv_packet[4];
+	int result;
+
+	snd_packet[0] = cmd;
+	snd_packet[1] = cmd;
+
+	result = lj_cmd_sync(state, snd_packet, sizeof(snd_packet),
+			rcv_packet, sizeof(rcv_packet));
+	if(result < 0)
+		return result;
+	if(result < sizeof(rcv_packet) || rcv_packet[1] != cmd + 1){
+		printk(KERN_INFO "bad response to stream command 0x%x\n", cmd);
+		return -EIO;
+	}
+	if(rcv_packet[2]){
+		printk(KERN_INFO "error in stream command 0x%x: %d\n", cmd,
+			rcv_packet[2]);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* configures the U3's stream, queues the IN urbs and starts it
+ * streaming. Called with stream_mutex held. */
+static int lj_stream_start(struct lj_state *state)
+{
+	struct lj_stream_config *cfg = &state->stream_cfg;
+	u8 snd_packet[12 + 2*LJ_STREAM_MAX_CHANNELS];
+	u8 rcv_packet[8];
+	int sndsize;
+	int result;
+	int i;
+
+	if(state->stream_err)
+		return state->stream_err;
+	if(state->stream_running)
+		return 0;
+
+	sndsize = 12 + 2*cfg->num_channels;
+	memset(snd_packet, 0, sizeof(snd_packet));
+	/* 8bit checksum */
+	snd_packet[1] = 0xf8;		/* extended command */
+	snd_packet[2] = cfg->num_channels + 3;
+	snd_packet[3] = 0x11;		/* StreamConfig */
+	/* 16bit checksum */
+	snd_packet[6] = cfg->num_channels;
+	snd_packet[7] = cfg->samples_per_packet;
+	snd_packet[8] = 0x00;		/* reserved */
+	snd_packet[9] = cfg->scan_config;
+	snd_packet[10] = cfg->scan_interval & 0xff;
+	snd_packet[11] = cfg->scan_interval >> 8;
+	for(i = 0; i < cfg->num_channels; i++){
+		snd_packet[12 + 2*i] = cfg->pchannel[i];
+		snd_packet[13 + 2*i] = cfg->nchannel[i];
+	}
+	fix_checksum16(snd_packet, sndsize);
+
+	result = lj_cmd_sync(state, snd_packet, sndsize,
+			rcv_packet, sizeof(rcv_packet));
+	if(result < 0)
+		return result;
+	if(result < sizeof(rcv_packet)){
+		printk(KERN_INFO "short response to StreamConfig\n");
+		return -EIO;
+	}
+	if(rcv_packet[6]){
+		printk(KERN_INFO "error in StreamConfig: %d\n", rcv_packet[6]);
+		return -EINVAL;
+	}
+
+	kfifo_reset(&state->stream_fifo);
+	memset(&state->stream_stats, 0, sizeof(state->stream_stats));
+	state->stream_next_pkt = 0;
+	state->stream_fails = 0;
+	state->stream_failed = 0;
+	state->stream_running = 1;
+
+	for(i = 0; i < LJ_STREAM_URBS; i++){
+		result = usb_submit_urb(state->stream_urbs[i], GFP_KERNEL);
+		if(result)
+			goto err_kill;
+	}
+
+	result = lj_stream_cmd(state, 0xa8); /* StreamStart */
+	if(result)
+		goto err_kill;
+
+	return 0;
+
+err_kill:
+	state->stream_running = 0;
+	for(i = 0; i < LJ_STREAM_URBS; i++)
+		usb_kill_urb(state->stream_urbs[i]);
+	return result;
+}
+
+/* stops the U3's stream and takes back the IN urbs. Called with
+ * stream_mutex held. */
+static void lj_stream_stop(struct lj_state *state)
+{
+	int i;
+
+	if(!state->stream_running)
+		return;
+
+	state->stream_running = 0;
+	if(!state->stream_err)
+		lj_stream_cmd(state, 0xb0); /* StreamStop */
+
+	for(i = 0; i < LJ_STREAM_URBS; i++)
+		usb_kill_urb(state->stream_urbs[i]);
+	/* nothing more is coming for anyone waiting in schr_read */
+	wake_up_interruptible(&state->s_waitqueue);
+}
+
+static int schr_open(struct inode *inode, struct file *file)
+{
+	struct lj_state *curstate;
+	int result;
+
+	if(chr_open(inode, file)){
+		return -ENODEV;
+	}
+	curstate = file->private_data;
+
+	mutex_lock(&curstate->stream_mutex);
+
+	/* the U3 only has one stream, so only one reader at a time */
+	if(curstate->stream_open){
+		result = -EBUSY;
+		goto error;
+	}
+	if(curstate->stream_err){
+		result = curstate->stream_err;
+		goto error;
+	}
+
+	result = kfifo_alloc(&curstate->stream_fifo, LJ_STREAM_FIFO_SIZE,
+			GFP_KERNEL);
+	if(result)
+		goto error;
+
+	result = lj_stream_alloc_urbs(curstate);
+	if(result)
+		goto err_fifo;
+
+	lj_stream_default_cfg(&curstate->stream_cfg);
+	curstate->stream_open = 1;
+	mutex_unlock(&curstate->stream_mutex);
+	return 0;
+
+err_fifo:
+	kfifo_free(&curstate->stream_fifo);
+error:
+	mutex_unlock(&curstate->stream_mutex);
+	lj_state_put(curstate);
+	return result;
+}
+
+static int schr_release(struct inode *inode, struct file *file)
+{
+	struct lj_state *curstate = file->private_data;
+
+	mutex_lock(&curstate->stream_mutex);
+	lj_stream_stop(curstate);
+	lj_stream_free_urbs(curstate);
+	kfifo_free(&curstate->stream_fifo);
+	curstate->stream_open = 0;
+	mutex_unlock(&curstate->stream_mutex);
+	lj_state_put(curstate);
+	return 0;
+}
+
+/* returns raw 16 bit samples in scan order. The stream is started by
+ * the first read after open or after LJ_IOC_STREAM_STOP. A read left
+ * waiting when the stream is stopped returns 0. If the urbs keep
+ * failing, the read that finds the fifo empty stops the stream and
+ * returns -EIO. */
+static ssize_t schr_read(struct file *file, char __user *buf, 
+			size_t size, loff_t *off)
+{
+	struct lj_state *curstate = file->private_data;
+	unsigned int copied;
+	int result;
+
+	if(size < sizeof(u16)){
+		return -EINVAL;
+	}
+
+	if(mutex_lock_interruptible(&curstate->stream_mutex))
+		return -ERESTARTSYS;
+
+	result = lj_stream_start(curstate);
+	if(result)
+		goto out;
+
+	while(kfifo_is_empty(&curstate->stream_fifo)){
+		if(ACCESS_ONCE(curstate->stream_failed)){
+			lj_stream_stop(curstate);
+			result = -EIO;
+			goto out;
+		}
+		if(!curstate->stream_running){
+			result = 0;
+			goto out;
+		}
+		mutex_unlock(&curstate->stream_mutex);
+		if(file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(curstate->s_waitqueue,
+				!kfifo_is_empty(&curstate->stream_fifo) ||
+				curstate->stream_err ||
+				!curstate->stream_running ||
+				ACCESS_ONCE(curstate->stream_failed)))
+			return -ERESTARTSYS;
+		if(curstate->stream_err)
+			return curstate->stream_err;
+		if(mutex_lock_interruptible(&curstate->stream_mutex))
+			return -ERESTARTSYS;
+	}
+
+	result = kfifo_to_user(&curstate->stream_fifo, buf, size, &copied);
+	if(!result)
+		result = copied;
+out:
+	mutex_unlock(&curstate->stream_mutex);
+	return result;
+}
+
+static long schr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct lj_state *curstate = file->private_data;
+	struct lj_stream_config cfg;
+	struct lj_stream_stats stats;
+	long result = 0;
+
+	switch(cmd){
+	case LJ_IOC_STREAM_CONFIG:
+		if(copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		if(cfg.num_channels < 1 ||
+			cfg.num_channels > LJ_STREAM_MAX_CHANNELS ||
+			cfg.samples_per_packet < 1 ||
+			cfg.samples_per_packet > 25)
+			return -EINVAL;
+		mutex_lock(&curstate->stream_mutex);
+		if(curstate->stream_running)
+			result = -EBUSY;
+		else
+			curstate->stream_cfg = cfg;
+		mutex_unlock(&curstate->stream_mutex);
+		return result;
+
+	case LJ_IOC_STREAM_STOP:
+		mutex_lock(&curstate->stream_mutex);
+		lj_stream_stop(curstate);
+		mutex_unlock(&curstate->stream_mutex);
+		return 0;
+
+	case LJ_IOC_STREAM_STATS:
+		spin_lock_irq(&curstate->stream_lock);
+		stats = curstate->stream_stats;
+		spin_unlock_irq(&curstate->stream_lock);
+		if(copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
+	return lj_common_ioctl(curstate, cmd, arg);
+}
+
 
 
 
@@ -1198,27 +6015,30 @@ static int __init lj_start(void)
 	int result = 0;
 	
 	printk(KERN_INFO "Hello, kernel!\n");
-	mutex_init(&state_table_lock);
-	lj_state_table = kzalloc(sizeof(struct usb_interface*) * MAXDEV, 
-				GFP_KERNEL);
-  
-	if(!lj_state_table){
-		printk(KERN_INFO 
-			"Could not allocate memory for interface table!\n");
-		goto error;
-	}
 
+	hrtimer_init(&lj_tick_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	lj_tick_timer.function = lj_tick_cbk;
+
+	lj_debugfs_root = debugfs_create_dir("labjack", NULL);
 
 	result =  usb_register(&usb_driver);
 	if (result){
 		printk(KERN_INFO "Could not register device: %d", result);
 		goto error_reg;
 	}
+
+	result = misc_register(&lj_group_device);
+	if (result){
+		printk(KERN_INFO "Could not register group device: %d",
+			result);
+		goto error_group;
+	}
 	
 	return 0;
+error_group:
+	usb_deregister(&usb_driver);
 error_reg:
-	kfree(lj_state_table);
-error:
+	debugfs_remove_recursive(lj_debugfs_root);
 	return -1;
 }
 
@@ -1227,9 +6047,15 @@ error:
 static void __exit lj_end(void)
 {
   
+	misc_deregister(&lj_group_device);
 	usb_deregister(&usb_driver);
-	kfree(lj_state_table);
-	mutex_destroy(&state_table_lock);
+	/* every labjack is off the tick by now */
+	hrtimer_cancel(&lj_tick_timer);
+	debugfs_remove_recursive(lj_debugfs_root);
+	/* wait for the kfree_rcu in lj_state_release */
+	rcu_barrier();
+	idr_destroy(&lj_minor_idr);
+	idr_destroy(&lj_idr);
 	printk(KERN_INFO "Goodbye, kernel!\n");
 }
 
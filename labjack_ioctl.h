@@ -0,0 +1,426 @@
+/*
+ * ioctl interface shared between the labjack driver and userspace.
+ */
+
+#ifndef LABJACK_IOCTL_H
+#define LABJACK_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define LJ_IOC_MAGIC 'j'
+
+/* the U3 can stream at most 25 channels per scan */
+#define LJ_STREAM_MAX_CHANNELS 25
+
+/* bits of lj_stream_config.scan_config */
+#define LJ_SCAN_CLOCK_48MHZ	(1 << 3) /* 48MHz stream clock instead of 4MHz */
+#define LJ_SCAN_DIV256		(1 << 1) /* divide the stream clock by 256 */
+
+/* configuration sent to the U3 with StreamConfig when the stream
+ * starts. Scans happen every scan_interval ticks of the stream
+ * clock. */
+struct lj_stream_config {
+	__u8 num_channels;
+	__u8 samples_per_packet;	/* 1 - 25 */
+	__u8 scan_config;		/* LJ_SCAN_* bits */
+	__u8 reserved;
+	__u16 scan_interval;
+	__u8 pchannel[LJ_STREAM_MAX_CHANNELS];
+	__u8 nchannel[LJ_STREAM_MAX_CHANNELS];
+};
+
+/* counters kept while the stream port is running */
+struct lj_stream_stats {
+	__u32 packets;			/* StreamData packets decoded */
+	__u32 lost_packets;		/* gaps in the packet counter */
+	__u32 overflow_samples;		/* samples dropped, ring was full */
+	__u32 device_errors;		/* packets with a nonzero errorcode */
+	__u32 urb_errors;		/* failed stream urbs */
+};
+
+#define LJ_IOC_STREAM_CONFIG	_IOW(LJ_IOC_MAGIC, 1, struct lj_stream_config)
+#define LJ_IOC_STREAM_STOP	_IO(LJ_IOC_MAGIC, 2)
+#define LJ_IOC_STREAM_STATS	_IOR(LJ_IOC_MAGIC, 3, struct lj_stream_stats)
+
+/* portB: period of the background tempurature sampler in ms, at
+ * least 10, or 0 to stop it. Applies to the whole labjack. */
+#define LJ_IOC_B_SAMPLE_PERIOD	_IOW(LJ_IOC_MAGIC, 10, __u32)
+/* portB: oldest sampled reading this file will return, in ms. Older
+ * readings go to the device. 0 means twice the sampler period. */
+#define LJ_IOC_B_MAX_AGE	_IOW(LJ_IOC_MAGIC, 11, __u32)
+/* portB: what read returns, one of LJ_B_FORMAT_*. Applies to this
+ * file only. */
+#define LJ_IOC_B_FORMAT		_IOW(LJ_IOC_MAGIC, 12, __u32)
+
+/* one int of degrees C per read, the default */
+#define LJ_B_FORMAT_INT		0
+/* as many lj_temp_records as fit. Each reading the labjack takes goes
+ * into a history ring, and a read returns every one this file hasn't
+ * seen, starting from the oldest the ring held when the format was
+ * set. A read only waits for the labjack if there are none. */
+#define LJ_B_FORMAT_RECORD	1
+
+#define LJ_TEMP_RECORD_VERSION 1
+
+/* bits of lj_temp_record.flags */
+#define LJ_TEMP_OVERRUN	(1 << 0) /* readings were lost before this one,
+				  * the file fell too far behind */
+
+struct lj_temp_record {
+	__u16 version;			/* LJ_TEMP_RECORD_VERSION */
+	__u16 size;			/* sizeof(struct lj_temp_record) */
+	__u32 flags;			/* LJ_TEMP_* bits */
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u32 raw;			/* AIN30 reading */
+	__s32 millicelsius;
+};
+
+/* number of rules portC evaluates */
+#define LJ_MAX_RULES 8
+
+/* bits of lj_rule.flags */
+#define LJ_RULE_ENABLED	(1 << 0)
+#define LJ_RULE_RISING	(1 << 1) /* raise an event on going high */
+#define LJ_RULE_FALLING	(1 << 2) /* raise an event on going low */
+#define LJ_RULE_AIRLOCK	(1 << 3) /* open the portC airlock while high */
+
+/* a threshold on one analog input, sampled every portC poll. Values
+ * are raw 16 bit readings. The input goes high at or above high and
+ * low at or below low, so high - low is the hysteresis band. It has
+ * to stay past the threshold for debounce samples in a row before the
+ * rule changes state. */
+struct lj_rule {
+	__u8 index;			/* 0 - LJ_MAX_RULES-1 */
+	__u8 channel;			/* positive AIN channel */
+	__u8 flags;			/* LJ_RULE_* bits */
+	__u8 debounce;
+	__u16 high;
+	__u16 low;
+	__u16 max_delta;		/* rate event if exceeded, 0 is off */
+	__u16 reserved;
+};
+
+/* lj_event.type */
+#define LJ_EVENT_HIGH	1
+#define LJ_EVENT_LOW	2
+#define LJ_EVENT_RATE	3
+
+struct lj_event {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC */
+	__u8 rule;
+	__u8 type;			/* LJ_EVENT_* */
+	__u16 value;			/* sample that raised the event */
+	__u32 reserved;
+};
+
+#define LJ_IOC_C_SET_RULE	_IOW(LJ_IOC_MAGIC, 20, struct lj_rule)
+#define LJ_IOC_C_GET_RULE	_IOWR(LJ_IOC_MAGIC, 21, struct lj_rule)
+#define LJ_IOC_C_GET_EVENT	_IOR(LJ_IOC_MAGIC, 22, struct lj_event)
+/* portC: how often the rules are sampled, in us. At least 2000.
+ * Sampling only runs while portC is open and has been read or polled,
+ * and goes up to 16 times faster while a rule is close to changing. */
+#define LJ_IOC_C_SET_PERIOD	_IOW(LJ_IOC_MAGIC, 23, __u32)
+#define LJ_IOC_C_GET_PERIOD	_IOR(LJ_IOC_MAGIC, 24, __u32)
+
+/* portA: period of the square wave on FIO4, in us, 0 to stop it.
+ * Periods up to about 16.7s are made by the U3's Timer0, and are
+ * rounded to what it can produce. Longer ones are toggled by the
+ * driver to the nearest 2s. GET returns the period in effect. */
+#define LJ_IOC_A_SET_PERIOD	_IOW(LJ_IOC_MAGIC, 30, __u32)
+#define LJ_IOC_A_GET_PERIOD	_IOR(LJ_IOC_MAGIC, 31, __u32)
+
+/* the most channels a scan list can hold. Up to 19 fit in one
+ * Feedback packet. */
+#define LJ_SCAN_MAX 32
+
+/* bits of lj_ain.flags */
+#define LJ_AIN_LONG_SETTLING	(1 << 0)
+#define LJ_AIN_QUICK_SAMPLE	(1 << 1) /* faster, but less resolution */
+
+/* one analog input. pchannel is 0-15 for FIO/EIO, 30 for the
+ * temperature sensor or 31 for Vreg. nchannel is 0-15, 30 for Vref,
+ * 31 for single ended, or 32 for the special range. */
+struct lj_ain {
+	__u8 pchannel;
+	__u8 nchannel;
+	__u8 flags;			/* LJ_AIN_* bits */
+	__u8 reserved;
+};
+
+struct lj_scan_list {
+	__u8 count;
+	__u8 reserved[3];
+	struct lj_ain ain[LJ_SCAN_MAX];
+};
+
+/* what a read of /dev/labNscan returns */
+struct lj_scan_record {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC, when the scan
+					 * was sent */
+	__u32 seq;			/* counts up by one every scan */
+	__u8 count;
+	__u8 reserved[3];
+	__u16 value[LJ_SCAN_MAX];	/* raw readings, in list order */
+	__s32 calibrated[LJ_SCAN_MAX];	/* the same in uV, or mC for the
+					 * temperature sensor */
+};
+
+/* scan: sets the channels every read returns. Any FIO or EIO line in
+ * the list is made analog. FIO4 is portA's, and the counter port's
+ * pins are digital, so they can't be used. */
+#define LJ_IOC_SCAN_SET		_IOW(LJ_IOC_MAGIC, 40, struct lj_scan_list)
+#define LJ_IOC_SCAN_GET		_IOR(LJ_IOC_MAGIC, 41, struct lj_scan_list)
+
+/* IOType bytes that fit in one Feedback command, and response bytes
+ * in one Feedback response */
+#define LJ_FB_MAX_CMD	57
+#define LJ_FB_MAX_RESP	55
+/* most ops one LJ_IOC_FEEDBACK takes */
+#define LJ_FB_MAX_OPS	64
+
+/* a sequence of Feedback IOTypes, sent and answered together. The
+ * driver doesn't look inside, so resp_len has to be what the IOTypes
+ * return, and frames how many of them there are. */
+struct lj_fb_op {
+	__u8 cmd_len;			/* 1 - LJ_FB_MAX_CMD */
+	__u8 resp_len;			/* 0 - LJ_FB_MAX_RESP */
+	__u8 frames;			/* IOTypes in cmd, 0 for 1 */
+	__u8 reserved;
+	__s32 result;			/* set to 0 or -errno */
+	__u8 cmd[LJ_FB_MAX_CMD];
+	__u8 resp[LJ_FB_MAX_RESP];
+};
+
+struct lj_feedback {
+	__u32 count;
+	__u32 reserved;
+	__u64 ops;			/* pointer to count lj_fb_ops */
+};
+
+/* any port: runs a vector of Feedback ops. The driver packs them into
+ * as few packets as fit, in order, and fills in every op's result and
+ * resp. If an op makes the U3 report an error, that op fails with
+ * -EIO. The ops before it have run and complete as usual. The ops
+ * after it have not run, so they are sent again, and no op runs twice.
+ * Returns the first op's error, if any did. */
+#define LJ_IOC_FEEDBACK		_IOW(LJ_IOC_MAGIC, 50, struct lj_feedback)
+
+/* lines in lj_dio masks: bits 0-7 are FIO0-7, 8-15 EIO0-7 and 16-19
+ * CIO0-3 */
+#define LJ_DIO_LINES	0xfffff
+
+/* levels and directions of the digital lines. Lines outside a mask
+ * are left alone. A direction of 1 is an output. FIO4 is portA's,
+ * analog lines are the scan port's and timer pins the counter port's,
+ * so none of them can be set here. */
+struct lj_dio {
+	__u32 state_mask;
+	__u32 state;
+	__u32 dir_mask;
+	__u32 dir;
+};
+
+/* dio: sets levels, then directions, in one Feedback packet. Lines the
+ * driver knows are already set are skipped, and if none are left
+ * nothing is sent. */
+#define LJ_IOC_DIO_SET		_IOW(LJ_IOC_MAGIC, 60, struct lj_dio)
+/* dio: reads every line's level and direction. Both masks come back
+ * as LJ_DIO_LINES. */
+#define LJ_IOC_DIO_GET		_IOR(LJ_IOC_MAGIC, 61, struct lj_dio)
+
+/* lj_count_config.timer_mode, the U3's timer input modes */
+#define LJ_COUNT_TIMER_OFF	0
+#define LJ_COUNT_PERIOD_RISING	2	/* ticks between rising edges */
+#define LJ_COUNT_PERIOD_FALLING	3	/* ticks between falling edges */
+#define LJ_COUNT_DUTY		4	/* high ticks in the low 16 bits,
+					 * low ticks in the high 16 */
+#define LJ_COUNT_EDGES		5	/* rising edges, counted by the
+					 * U3's firmware */
+
+/* the counter port's input timer and hardware counter. The timer is
+ * on FIO5, and Counter1 on the next free FIO after it. */
+struct lj_count_config {
+	__u8 timer_mode;		/* LJ_COUNT_* */
+	__u8 counter;			/* 1 to count edges on Counter1 */
+	__u16 reserved;
+};
+
+/* what a read of /dev/labNcount returns */
+struct lj_count_record {
+	__u64 timestamp_ns;		/* CLOCK_MONOTONIC, when the read
+					 * was sent */
+	__u32 timer;			/* the input timer's value */
+	__u32 counter;			/* Counter1's edge count */
+	__u32 tick_ns;			/* length of a timer tick */
+	__u8 timer_mode;
+	__u8 counter_on;
+	__u16 reserved;
+};
+
+/* count: sets the input timer mode and turns Counter1 on or off. The
+ * timer clock is shared with portA, so its tick changes when portA
+ * starts or stops using Timer0, and the timer starts over. */
+#define LJ_IOC_COUNT_CONFIG	_IOW(LJ_IOC_MAGIC, 70, struct lj_count_config)
+/* count: reads like read does, and zeroes the edge counts */
+#define LJ_IOC_COUNT_READ_RESET	_IOR(LJ_IOC_MAGIC, 71, struct lj_count_record)
+
+/* scheduling classes. Every request to a labjack is in one, and the
+ * classes are served in this order. */
+#define LJ_PRIO_OUTPUT		0	/* portA, dio and timer writes */
+#define LJ_PRIO_POLL		1	/* portC rules, the portB sampler
+					 * and IIO triggers */
+#define LJ_PRIO_BULK		2	/* everything else */
+#define LJ_NUM_PRIO		3
+
+/* a class's rate limit. While other classes have requests waiting, a
+ * class gets at most rate requests a second, with bursts of up to
+ * burst. With nothing else waiting, the limit doesn't apply. */
+struct lj_sched_limit {
+	__u32 prio;			/* LJ_PRIO_* */
+	__u32 rate;			/* requests a second, 0 for none */
+	__u32 burst;			/* at least 1 */
+	__u32 reserved;
+};
+
+/* how a class has been doing. Waits run from a request being queued
+ * to it going out. */
+struct lj_sched_stats {
+	__u32 prio;			/* LJ_PRIO_*, set by the caller */
+	__u32 depth;			/* requests waiting now */
+	__u32 max_depth;		/* most waiting since the last
+					 * LJ_IOC_SCHED_STATS */
+	__u32 rate;
+	__u32 burst;
+	__u32 reserved;
+	__u64 sent;			/* requests sent */
+	__u64 throttled;		/* times it was passed over for
+					 * being over its rate */
+	__u64 wait_ns_total;		/* summed over sent */
+	__u64 wait_ns_max;		/* since the last LJ_IOC_SCHED_STATS */
+};
+
+/* any port: sets a class's rate limit */
+#define LJ_IOC_SCHED_LIMIT	_IOW(LJ_IOC_MAGIC, 80, struct lj_sched_limit)
+/* any port: reads a class's stats, and starts its maximums over */
+#define LJ_IOC_SCHED_STATS	_IOWR(LJ_IOC_MAGIC, 81, struct lj_sched_stats)
+
+/* lj_out_step.type */
+#define LJ_OUT_DAC0	0
+#define LJ_OUT_DAC1	1
+#define LJ_OUT_DIO	2
+
+/* steps that land within a tick of each other go out in one Feedback
+ * packet. It is the USB frame, the fastest packets go out anyway. */
+#define LJ_OUT_TICK_NS	1000000
+
+/* one step written to /dev/labNout. It plays time_ns after
+ * LJ_IOC_OUT_START, and steps have to be written in time order. Where
+ * steps in one tick set the same output, the last one wins. DIO steps
+ * only set levels, so make the lines outputs with the dio port first. */
+struct lj_out_step {
+	__u64 time_ns;
+	__u8 type;			/* LJ_OUT_* */
+	__u8 reserved[3];
+	__s32 value;			/* DAC: uV. DIO: levels */
+	__u32 mask;			/* DIO: lines to set, as in lj_dio */
+	__u32 reserved2;
+};
+
+struct lj_out_stats {
+	__u64 played;			/* steps sent */
+	__u64 packets;			/* Feedback packets they took */
+	__u64 late;			/* steps sent a tick or more after
+					 * their time */
+	__u64 late_max_ns;
+	__u32 underruns;		/* times playback ran out of steps,
+					 * the last step included */
+	__u32 errors;			/* packets the U3 didn't take */
+	__u32 queued;			/* steps waiting to play */
+	__u32 running;
+};
+
+/* out: starts playing the steps from time 0, now, and zeroes the
+ * stats. Steps can be written before and while it plays. */
+#define LJ_IOC_OUT_START	_IO(LJ_IOC_MAGIC, 90)
+/* out: stops playing and throws away the steps still waiting. The
+ * outputs stay where the last step left them. */
+#define LJ_IOC_OUT_STOP		_IO(LJ_IOC_MAGIC, 91)
+#define LJ_IOC_OUT_STATS	_IOR(LJ_IOC_MAGIC, 92, struct lj_out_stats)
+
+/* channels one sampling group reads on each tick */
+#define LJ_GROUP_MAX	16
+/* fastest a group ticks */
+#define LJ_GROUP_MIN_PERIOD_US	1000
+
+/* a channel of a group: an AIN of /dev/labN, N being devid. A labjack
+ * can be in a group more than once. */
+struct lj_group_member {
+	__u32 devid;
+	struct lj_ain ain;
+};
+
+/* a sampling group, set up on a file opened from /dev/labjack_group */
+struct lj_group_config {
+	__u32 period_us;		/* 0 stops the group */
+	__u32 count;
+	struct lj_group_member member[LJ_GROUP_MAX];
+};
+
+struct lj_group_sample {
+	__u64 done_ns;			/* CLOCK_MONOTONIC, when the
+					 * labjack's response came back */
+	__s32 calibrated;		/* uV, or mC for the temperature
+					 * sensor */
+	__u16 raw;
+	__s16 result;			/* 0 or -errno */
+};
+
+/* what a read of a group returns, one per tick */
+struct lj_group_record {
+	__u64 tick;			/* counts up from 0 when the group
+					 * is set up */
+	__u64 tick_ns;			/* CLOCK_MONOTONIC, when the tick
+					 * sent the reads */
+	__u32 count;
+	__u32 missed;			/* ticks skipped or records dropped
+					 * since the last record */
+	struct lj_group_sample sample[LJ_GROUP_MAX];
+};
+
+/* labjack_group: binds the channels to one timer and starts it. Each
+ * tick sends every channel's read back to back, and the record comes
+ * out once they are all back. A tick that comes while the last one's
+ * reads are still out is skipped. Lines a channel reads are made
+ * analog, as the scan port does. */
+#define LJ_IOC_GROUP_SET	_IOW(LJ_IOC_MAGIC, 100, struct lj_group_config)
+
+#define LJ_STATUS_VERSION 1
+
+/* values of lj_status_page.airlock */
+#define LJ_AIRLOCK_OPEN		0
+#define LJ_AIRLOCK_CLOSED	1
+#define LJ_AIRLOCK_ERROR	2
+
+/* the read only page mapped from /dev/labNstatus. The driver makes seq
+ * odd while it updates the page, so a reader copies the fields out
+ * and retries if seq was odd or changed meanwhile. Times are
+ * CLOCK_MONOTONIC in ns, 0 if never. */
+struct lj_status_page {
+	__u32 seq;
+	__u32 version;			/* LJ_STATUS_VERSION */
+	__s32 temp;			/* last portB reading, degrees C */
+	__u32 airlock;			/* LJ_AIRLOCK_* */
+	__u32 fio4_state;
+	__u32 a_period_us;		/* portA period, 0 if stopped */
+	__u64 temp_ns;
+	__u64 airlock_ns;		/* last change of the airlock */
+	__u64 fio4_ns;			/* last host toggle, or when Timer0
+					 * started driving fio4 */
+	__u32 temp_count;		/* updates of each field */
+	__u32 airlock_count;
+	__u32 fio4_count;
+	__u32 reserved;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Tracepoints for the labjack driver. Turn them on with
+ *	echo 1 > /sys/kernel/debug/tracing/events/labjack/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM labjack
+
+#ifndef LABJACK_TRACE_KINDS
+#define LABJACK_TRACE_KINDS
+
+/* what a request does, for the tracepoints and latency histograms */
+enum lj_kind {
+	LJ_KIND_AIN,		/* analog in */
+	LJ_KIND_TEMP,		/* analog in of the temperature sensor */
+	LJ_KIND_BIT_WRITE,	/* BitStateWrite */
+	LJ_KIND_FEEDBACK,	/* any other Feedback IOType */
+	LJ_KIND_CONFIG_IO,	/* ConfigIO */
+	LJ_KIND_RAW,		/* any other raw command */
+	LJ_NUM_KINDS
+};
+
+#endif
+
+#if !defined(LABJACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define LABJACK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define lj_show_kind(kind)					\
+	__print_symbolic(kind,					\
+			{ LJ_KIND_AIN,		"ain" },	\
+			{ LJ_KIND_TEMP,		"temp" },	\
+			{ LJ_KIND_BIT_WRITE,	"bitwrite" },	\
+			{ LJ_KIND_FEEDBACK,	"feedback" },	\
+			{ LJ_KIND_CONFIG_IO,	"configio" },	\
+			{ LJ_KIND_RAW,		"raw" })
+
+/* a request was queued */
+TRACE_EVENT(lj_req_submit,
+	TP_PROTO(int devid, int kind, const u8 *cmd),
+	TP_ARGS(devid, kind, cmd),
+	TP_STRUCT__entry(
+		__field(int, devid)
+		__field(int, kind)
+		__field(u8, cmd0)
+		__field(u8, cmd1)
+	),
+	TP_fast_assign(
+		__entry->devid = devid;
+		__entry->kind = kind;
+		__entry->cmd0 = cmd[0];
+		__entry->cmd1 = cmd[1];
+	),
+	TP_printk("lab%d %s %02x %02x", __entry->devid,
+		lj_show_kind(__entry->kind), __entry->cmd0, __entry->cmd1)
+);
+
+/* a request completed, latency_ns after it was queued */
+TRACE_EVENT(lj_req_done,
+	TP_PROTO(int devid, int kind, int result, u64 latency_ns),
+	TP_ARGS(devid, kind, result, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, devid)
+		__field(int, kind)
+		__field(int, result)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->devid = devid;
+		__entry->kind = kind;
+		__entry->result = result;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("lab%d %s result %d latency %lluns", __entry->devid,
+		lj_show_kind(__entry->kind), __entry->result,
+		__entry->latency_ns)
+);
+
+/* a packet went out on EP1, carrying nreqs requests */
+TRACE_EVENT(lj_xfer_send,
+	TP_PROTO(int devid, u8 echo, int raw, int nreqs, int len),
+	TP_ARGS(devid, echo, raw, nreqs, len),
+	TP_STRUCT__entry(
+		__field(int, devid)
+		__field(u8, echo)
+		__field(int, raw)
+		__field(int, nreqs)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->devid = devid;
+		__entry->echo = echo;
+		__entry->raw = raw;
+		__entry->nreqs = nreqs;
+		__entry->len = len;
+	),
+	TP_printk("lab%d %s echo %u reqs %d len %d", __entry->devid,
+		__entry->raw ? "raw" : "feedback", __entry->echo,
+		__entry->nreqs, __entry->len)
+);
+
+/* a packet's response came back, or it failed with status */
+TRACE_EVENT(lj_xfer_done,
+	TP_PROTO(int devid, u8 echo, int status, int len),
+	TP_ARGS(devid, echo, status, len),
+	TP_STRUCT__entry(
+		__field(int, devid)
+		__field(u8, echo)
+		__field(int, status)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->devid = devid;
+		__entry->echo = echo;
+		__entry->status = status;
+		__entry->len = len;
+	),
+	TP_printk("lab%d echo %u status %d len %d", __entry->devid,
+		__entry->echo, __entry->status, __entry->len)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE labjack_trace
+#include <trace/define_trace.h>
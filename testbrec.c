@@ -0,0 +1,41 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_temp_record recs[16];
+  unsigned int format = LJ_B_FORMAT_RECORD;
+  unsigned int period = 100;
+  int result;
+  int i;
+  int desc = open("/dev/lab0portB", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open portB");
+      return -1;
+    }
+  ioctl(desc, LJ_IOC_B_SAMPLE_PERIOD, &period);
+  if (ioctl(desc, LJ_IOC_B_FORMAT, &format) < 0)
+    {
+      perror("Could not set record format");
+      close(desc);
+      return -1;
+    }
+  /* let a backlog build up */
+  sleep(1);
+  result = read(desc, recs, sizeof(recs));
+  if (result < 0)
+    {
+      perror("Something messed up");
+      close(desc);
+      return -1;
+    }
+  for (i = 0; i < result / (int)sizeof(recs[0]); i++)
+    printf("%llu ns: raw %u, %d mC%s\n",
+	   (unsigned long long)recs[i].timestamp_ns, recs[i].raw,
+	   recs[i].millicelsius,
+	   (recs[i].flags & LJ_TEMP_OVERRUN) ? " (overrun)" : "");
+  close(desc);
+}
@@ -0,0 +1,35 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_count_config cfg = { 0 };
+  struct lj_count_record rec;
+  int desc = open("/dev/lab0count", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open counter port");
+      return -1;
+    }
+  /* period of the signal on FIO5, and edges on FIO6 */
+  cfg.timer_mode = LJ_COUNT_PERIOD_RISING;
+  cfg.counter = 1;
+  if (ioctl(desc, LJ_IOC_COUNT_CONFIG, &cfg) < 0)
+    {
+      perror("Could not configure counters");
+      close(desc);
+      return -1;
+    }
+  sleep(1);
+  if (read(desc, &rec, sizeof(rec)) < 0)
+    {
+      perror("Something messed up");
+      close(desc);
+      return -1;
+    }
+  printf("period %llu ns, %u edges\n",
+	 (unsigned long long)rec.timer * rec.tick_ns, rec.counter);
+  close(desc);
+}
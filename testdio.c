@@ -0,0 +1,30 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_dio dio;
+  int desc = open("/dev/lab0dio", O_RDWR);
+  if (desc < 0)
+    {
+      perror("Could not open dio port");
+      return -1;
+    }
+  /* make CIO0-3 outputs, and set them to 0101 */
+  dio.state_mask = 0xf << 16;
+  dio.state = 0x5 << 16;
+  dio.dir_mask = 0xf << 16;
+  dio.dir = 0xf << 16;
+  if (ioctl(desc, LJ_IOC_DIO_SET, &dio) < 0)
+    perror("Could not set lines");
+  if (ioctl(desc, LJ_IOC_DIO_GET, &dio) < 0)
+    {
+      perror("Could not read lines");
+      close(desc);
+      return -1;
+    }
+  printf("state %05x dir %05x\n", dio.state, dio.dir);
+  close(desc);
+}
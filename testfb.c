@@ -0,0 +1,36 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_fb_op ops[2] = {{ 0 }};
+  struct lj_feedback fb;
+  int desc = open("/dev/lab0portB", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open portB");
+      return -1;
+    }
+  /* BitStateRead of FIO4 */
+  ops[0].cmd_len = 2;
+  ops[0].resp_len = 1;
+  ops[0].cmd[0] = 10;
+  ops[0].cmd[1] = 4;
+  /* AIN30, the temperature sensor */
+  ops[1].cmd_len = 3;
+  ops[1].resp_len = 2;
+  ops[1].cmd[0] = 1;
+  ops[1].cmd[1] = 30;
+  ops[1].cmd[2] = 31;
+  fb.count = 2;
+  fb.reserved = 0;
+  fb.ops = (uintptr_t)ops;
+  if (ioctl(desc, LJ_IOC_FEEDBACK, &fb) < 0)
+    perror("Feedback failed");
+  printf("fio4 is %d (%d), raw temp is %d (%d)\n", ops[0].resp[0],
+	 ops[0].result, ops[1].resp[0] + (ops[1].resp[1] << 8), ops[1].result);
+  close(desc);
+}
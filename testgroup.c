@@ -0,0 +1,50 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_group_config cfg;
+  struct lj_group_record rec;
+  int i;
+  unsigned int j;
+  int desc = open("/dev/labjack_group", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open labjack_group");
+      return -1;
+    }
+  /* the temperature sensor of lab0 and lab1, every 10ms */
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.period_us = 10000;
+  cfg.count = 2;
+  for (i = 0; i < 2; i++)
+    {
+      cfg.member[i].devid = i;
+      cfg.member[i].ain.pchannel = 30;
+      cfg.member[i].ain.nchannel = 31;
+    }
+  if (ioctl(desc, LJ_IOC_GROUP_SET, &cfg) < 0)
+    {
+      perror("Could not set up group");
+      return -1;
+    }
+  for (i = 0; i < 10; i++)
+    {
+      if (read(desc, &rec, sizeof(rec)) < (int)sizeof(rec))
+	{
+	  perror("Could not read group");
+	  break;
+	}
+      printf("tick %llu (%u missed):", (unsigned long long)rec.tick,
+	     rec.missed);
+      for (j = 0; j < rec.count; j++)
+	printf(" %dmC after %lluus (%d)", rec.sample[j].calibrated,
+	       (unsigned long long)(rec.sample[j].done_ns - rec.tick_ns) / 1000,
+	       rec.sample[j].result);
+      printf("\n");
+    }
+  close(desc);
+}
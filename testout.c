@@ -0,0 +1,41 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+#define STEPS 200
+int main()
+{
+  struct lj_out_step steps[STEPS];
+  struct lj_out_stats st;
+  int i;
+  int desc = open("/dev/lab0out", O_WRONLY);
+  if (desc < 0)
+    {
+      perror("Could not open out port");
+      return -1;
+    }
+  /* a 0 to 4V sawtooth on DAC0, one step a ms */
+  memset(steps, 0, sizeof(steps));
+  for (i = 0; i < STEPS; i++)
+    {
+      steps[i].time_ns = i * 1000000ULL;
+      steps[i].type = LJ_OUT_DAC0;
+      steps[i].value = (i % 50) * 80000;
+    }
+  if (write(desc, steps, sizeof(steps)) < 0)
+    perror("Could not queue steps");
+  if (ioctl(desc, LJ_IOC_OUT_START) < 0)
+    perror("Could not start playback");
+  sleep(1);
+  if (ioctl(desc, LJ_IOC_OUT_STATS, &st) < 0)
+    perror("Could not read stats");
+  printf("played %llu steps in %llu packets, %llu late (max %lluus), "
+	 "%u underruns, %u errors\n", (unsigned long long)st.played,
+	 (unsigned long long)st.packets, (unsigned long long)st.late,
+	 (unsigned long long)st.late_max_ns / 1000, st.underruns, st.errors);
+  ioctl(desc, LJ_IOC_OUT_STOP);
+  close(desc);
+}
@@ -0,0 +1,40 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  struct lj_scan_list list = { 0 };
+  struct lj_scan_record rec;
+  int i;
+  int desc = open("/dev/lab0scan", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open scan port");
+      return -1;
+    }
+  /* AIN10 single ended, then the temperature sensor */
+  list.count = 2;
+  list.ain[0].pchannel = 10;
+  list.ain[0].nchannel = 31;
+  list.ain[1].pchannel = 30;
+  list.ain[1].nchannel = 31;
+  if (ioctl(desc, LJ_IOC_SCAN_SET, &list) < 0)
+    {
+      perror("Could not set scan list");
+      close(desc);
+      return -1;
+    }
+  if (read(desc, &rec, sizeof(rec)) < 0)
+    {
+      perror("Something messed up");
+      close(desc);
+      return -1;
+    }
+  printf("scan %u at %llu ns:", rec.seq, (unsigned long long)rec.timestamp_ns);
+  for (i = 0; i < rec.count; i++)
+    printf(" %u (%d)", rec.value[i], rec.calibrated[i]);
+  printf("\n");
+  close(desc);
+}
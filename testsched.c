@@ -0,0 +1,32 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  const char *names[LJ_NUM_PRIO] = { "output", "poll", "bulk" };
+  struct lj_sched_stats st;
+  int prio;
+  int desc = open("/dev/lab0portB", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open portB");
+      return -1;
+    }
+  for (prio = 0; prio < LJ_NUM_PRIO; prio++)
+    {
+      st.prio = prio;
+      if (ioctl(desc, LJ_IOC_SCHED_STATS, &st) < 0)
+	{
+	  perror("Could not read scheduler stats");
+	  break;
+	}
+      printf("%s: depth %u (max %u), sent %llu, throttled %llu, "
+	     "max wait %lluus\n", names[prio], st.depth, st.max_depth,
+	     (unsigned long long)st.sent, (unsigned long long)st.throttled,
+	     (unsigned long long)st.wait_ns_max / 1000);
+    }
+  close(desc);
+}
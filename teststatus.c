@@ -0,0 +1,37 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  const volatile struct lj_status_page *page;
+  struct lj_status_page copy;
+  unsigned int seq;
+  int desc = open("/dev/lab0status", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open status port");
+      return -1;
+    }
+  page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, desc, 0);
+  if (page == MAP_FAILED)
+    {
+      perror("Could not map status page");
+      close(desc);
+      return -1;
+    }
+  /* retry while the driver is writing the page */
+  do
+    {
+      seq = page->seq;
+      __sync_synchronize();
+      copy = *(const struct lj_status_page *)page;
+      __sync_synchronize();
+    }
+  while ((seq & 1) || seq != page->seq);
+  printf("temp is %d C, airlock is %u, fio4 is %u, portA period %u us\n",
+	 copy.temp, copy.airlock, copy.fio4_state, copy.a_period_us);
+  munmap((void *)page, sizeof(*page));
+  close(desc);
+}
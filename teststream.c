@@ -0,0 +1,36 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "labjack_ioctl.h"
+int main()
+{
+  const int NSAMPLES = 1000;
+  unsigned short samples[NSAMPLES];
+  struct lj_stream_stats stats;
+  int total = 0;
+  int result;
+  int desc = open("/dev/lab0stream", O_RDONLY);
+  if (desc < 0)
+    {
+      perror("Could not open stream port");
+      return -1;
+    }
+  while (total < NSAMPLES)
+    {
+      result = read(desc, samples + total,
+		    sizeof(unsigned short)*(NSAMPLES - total));
+      if (result < 0)
+	{
+	  perror("Something messed up");
+	  close(desc);
+	  return -1;
+	}
+      total += result / sizeof(unsigned short);
+    }
+  ioctl(desc, LJ_IOC_STREAM_STATS, &stats);
+  printf("first sample: %d last sample: %d\n", samples[0], samples[NSAMPLES-1]);
+  printf("packets: %u lost: %u overflow: %u\n", stats.packets,
+	 stats.lost_packets, stats.overflow_samples);
+  close(desc);
+}